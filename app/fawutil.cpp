@@ -28,7 +28,9 @@
 #include <cstdint>
 #include <chrono>
 #include <array>
+#include <atomic>
 #include <filesystem>
+#include <thread>
 #include "rgy_osdep.h"
 #include "rgy_tchar.h"
 #include "rgy_faw.h"
@@ -36,6 +38,14 @@
 #if defined(_WIN32) || defined(_WIN64)
 #include <fcntl.h>
 #include <shellapi.h>
+#else
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#if ENABLE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
 #endif
 
 enum {
@@ -46,49 +56,1274 @@ enum {
 static void print_help() {
     _ftprintf(stdout, _T("fawutil %s\n"), VER_STR_FILEVERSION_TCHAR);
     _ftprintf(stdout, _T("wav -> aac\n"));
-    _ftprintf(stdout, _T("  fawutil [-D] input.wav [output.aac]\n"));
+    _ftprintf(stdout, _T("  fawutil [-D] [-tn] [-mn] [-n] [-lxxx] input.wav [output.aac]\n"));
+    _ftprintf(stdout, _T("    -tn n = threads (0:auto)\n"));
+    _ftprintf(stdout, _T("    -mn n = 0:read 1:mmap(default) 2:mmap + huge pages 3:io_uring\n"));
+    _ftprintf(stdout, _T("    -n  drop processed data from page cache\n"));
+    _ftprintf(stdout, _T("    -lxxx streaming mode, write output within xxx ms (0: after each block)\n"));
     _ftprintf(stdout, _T("\n"));
     _ftprintf(stdout, _T("aac -> wav\n"));
-    _ftprintf(stdout, _T("  fawutil [-E] [-sn] [-dxxx] input.aac [output.wav]\n"));
+    _ftprintf(stdout, _T("  fawutil [-E] [-sn] [-dxxx] [-tn] [-mn] [-n] [-lxxx] [-i] input.aac [output.wav]\n"));
     _ftprintf(stdout, _T("    n = 1 or 2(1:1/1 2:1/2)\n"));
     _ftprintf(stdout, _T("    xxx ... in ms\n"));
+    _ftprintf(stdout, _T("    -mn n = 0:read 1:mmap(default) 3:io_uring\n"));
+    _ftprintf(stdout, _T("    -n  drop processed data from page cache\n"));
+    _ftprintf(stdout, _T("    -lxxx streaming mode, write output within xxx ms (0: after each block)\n"));
+    _ftprintf(stdout, _T("    -i  add block index chunk (\"fawi\") after data\n"));
+}
+
+static bool is_pipe(const TCHAR *file) {
+    return file && _tcscmp(file, _T("-")) == 0;
+}
+
+static std::unique_ptr<FILE, decltype(&fclose)> open_file(const tstring& filename, const bool input) {
+    std::unique_ptr<FILE, decltype(&fclose)>fp(nullptr, fclose);
+    FILE *fptr = nullptr;
+    if (is_pipe(filename.c_str())) {
+        fptr = input ? stdin : stdout;
+#if defined(_WIN32) || defined(_WIN64)
+        if (_setmode(_fileno(fptr), _O_BINARY) < 0) {
+            _ftprintf(stderr, _T("failed to switch %s to binary mode.\n"), input ? _T("stdin") : _T("stdout"));
+            return fp;
+        }
+#endif //#if defined(_WIN32) || defined(_WIN64)
+    } else {
+        if (_tfopen_s(&fptr, filename.c_str(), input ? _T("rb") : _T("wb")) != 0 || fptr == nullptr) {
+            _ftprintf(stderr, _T("failed to open %s file: %s!\n"), input ? _T("input") : _T("output"), filename.c_str());
+            return fp;
+        }
+    }
+    return std::move(std::unique_ptr<FILE, decltype(&fclose)>(fptr, fclose));
+}
+
+static size_t write_buffer(std::unique_ptr<FILE, decltype(&fclose)>& fp, const tstring& filename, uint64_t& writeBytesTotal, const uint8_t *buf, size_t bufSize) {
+    if (bufSize > 0) {
+        if (!fp) {
+            fp = open_file(filename, false);
+        }
+        auto written = _fwrite_nolock(buf, 1, bufSize, fp.get());
+        writeBytesTotal += written;
+        return written;
+    }
+    return 0;
+}
+
+static const size_t WRITE_ZERO_BUF_SIZE = 64 * 1024;
+static const size_t WRITE_MIX_SIZE = 1024 * 1024;
+static const size_t ENCODE_MIX_READ_SIZE = 1024 * 1024;
+static const size_t ENCODE_MIX_QUEUE_SIZE = 4;
+static const size_t PIPELINE_QUEUE_SIZE = 2;
+static const size_t ENCODE_READ_SIZE = 4 * 1024 * 1024;
+static const size_t ENCODE_WRITE_SIZE = 4 * 1024 * 1024;
+static const size_t IO_URING_DEPTH = 4;
+static const size_t IO_URING_WRITE_SIZE = 4 * 1024 * 1024;
+static const int MMAP_MODE_IO_URING = 3;
+static const size_t CACHE_DROP_SIZE = 32 * 1024 * 1024;
+static const size_t STREAM_BUFFER_SIZE = 1024 * 1024;
+
+// 0をsize byte出力する
+// 通常のファイルの場合、大きな0の連続はシークして書き込まない (ファイルの長さを確定させるため、最後の1byteのみ書き込む)
+static uint64_t write_zero(std::unique_ptr<FILE, decltype(&fclose)>& fp, const tstring& filename, uint64_t& writeBytesTotal, uint64_t size) {
+    if (size == 0) {
+        return 0;
+    }
+    if (!fp) {
+        fp = open_file(filename, false);
+    }
+    static const std::array<uint8_t, WRITE_ZERO_BUF_SIZE> zero = { 0 };
+    uint64_t written = 0;
+    if (!is_pipe(filename.c_str()) && size > zero.size()
+        && _fseeki64(fp.get(), (int64_t)(size - 1), SEEK_CUR) == 0) {
+        writeBytesTotal += size - 1;
+        written = size - 1;
+    }
+    while (written < size) {
+        const auto ret = write_buffer(fp, filename, writeBytesTotal, zero.data(), (size_t)std::min<uint64_t>(zero.size(), size - written));
+        if (ret == 0) {
+            break;
+        }
+        written += ret;
+    }
+    return written;
+}
+
+static uint64_t write_encoder_output(std::unique_ptr<FILE, decltype(&fclose)>& fp, const tstring& filename, uint64_t& writeBytesTotal, RGYFAWEncoderOutput& out) {
+    uint64_t written = write_zero(fp, filename, writeBytesTotal, out.zeroHead);
+    written += write_buffer(fp, filename, writeBytesTotal, out.data.data(), out.data.size());
+    written += write_zero(fp, filename, writeBytesTotal, out.zeroTail);
+    out.clear();
+    return written;
+}
+
+// ストリーミング時の入力 (届いた分だけ読み取る)
+// timeout ms以内にデータが届かない場合は0を返し、最後まで読み取った場合は-1を返す (timeoutが負の場合は届くまで待つ)
+static int64_t stream_read(FILE *fp, uint8_t *buf, const size_t size, const int timeout) {
+#if defined(_WIN32) || defined(_WIN64)
+    const int fd = _fileno(fp);
+    size_t readSize = std::min<size_t>(size, INT_MAX);
+    const HANDLE handle = (HANDLE)_get_osfhandle(fd);
+    if (timeout >= 0 && GetFileType(handle) == FILE_TYPE_PIPE) {
+        // パイプはWaitForSingleObjectでは待てないので、届いたデータ量を確認しながら待つ
+        const auto start = std::chrono::steady_clock::now();
+        for (;;) {
+            DWORD avail = 0;
+            if (!PeekNamedPipe(handle, nullptr, 0, nullptr, &avail, nullptr)) {
+                break; // 書き込み側が閉じられた場合などは、_readで終了を検出する
+            }
+            if (avail > 0) {
+                readSize = std::min<size_t>(readSize, avail);
+                break;
+            }
+            if (std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(timeout)) {
+                return 0;
+            }
+            Sleep(1);
+        }
+    }
+    const int ret = _read(fd, buf, (unsigned int)readSize);
+    return (ret > 0) ? ret : -1;
+#else
+    const int fd = fileno(fp);
+    for (;;) {
+        pollfd pfd = { fd, POLLIN, 0 };
+        const int ready = poll(&pfd, 1, timeout);
+        if (ready == 0) {
+            return 0;
+        }
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        const auto ret = ::read(fd, buf, size);
+        if (ret > 0) {
+            return ret;
+        }
+        if (ret < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        }
+        return -1;
+    }
+#endif
+}
+
+// ストリーミング時の出力
+// 出力をためておき、ためた出力のもとになった入力が届いてからlatency ms経過したら書き出す (0の場合は毎回書き出す)
+// 書き出すたびに、もとになった入力が届いてから書き出すまでの時間を記録する
+class FAWStreamOutput {
+private:
+    std::unique_ptr<FILE, decltype(&fclose)>& fp;
+    const tstring& filename;
+    uint64_t& writeBytesTotal;
+    const int latency;
+    std::vector<uint8_t> buffer;
+    std::vector<std::chrono::steady_clock::time_point> arrivals; // ためている各出力のもとになった入力が届いた時刻
+    uint64_t count;
+    double latencySum; // ms
+    double latencyMax; // ms
+public:
+    FAWStreamOutput(std::unique_ptr<FILE, decltype(&fclose)>& fp, const tstring& filename, uint64_t& writeBytesTotal, const int latency);
+    void write(const uint8_t *data, const size_t size, const std::chrono::steady_clock::time_point arrival);
+    void writeZero(uint64_t size, const std::chrono::steady_clock::time_point arrival);
+    void update();
+    void flush();
+    int timeout() const;
+    void print() const;
+};
+
+FAWStreamOutput::FAWStreamOutput(std::unique_ptr<FILE, decltype(&fclose)>& fp_, const tstring& filename_, uint64_t& writeBytesTotal_, const int latency_) :
+    fp(fp_),
+    filename(filename_),
+    writeBytesTotal(writeBytesTotal_),
+    latency(latency_),
+    buffer(),
+    arrivals(),
+    count(0),
+    latencySum(0.0),
+    latencyMax(0.0) {
+    buffer.reserve(STREAM_BUFFER_SIZE);
+}
+
+// arrivalは、dataのもとになった入力が届いた時刻
+void FAWStreamOutput::write(const uint8_t *data, const size_t size, const std::chrono::steady_clock::time_point arrival) {
+    if (size == 0) {
+        return;
+    }
+    if (arrivals.empty() || arrivals.back() != arrival) {
+        arrivals.push_back(arrival);
+    }
+    buffer.insert(buffer.end(), data, data + size);
+    if (latency == 0 || buffer.size() >= STREAM_BUFFER_SIZE) {
+        flush();
+    }
+}
+
+void FAWStreamOutput::writeZero(uint64_t size, const std::chrono::steady_clock::time_point arrival) {
+    // 0はまとめてbufferにため、latencyによる書き出しの判定は最後に1回だけ行う
+    while (size > 0) {
+        if (arrivals.empty() || arrivals.back() != arrival) {
+            arrivals.push_back(arrival);
+        }
+        const size_t length = (size_t)std::min<uint64_t>(size, STREAM_BUFFER_SIZE - buffer.size());
+        buffer.insert(buffer.end(), length, 0);
+        size -= length;
+        if (buffer.size() >= STREAM_BUFFER_SIZE) {
+            flush();
+        }
+    }
+    if (latency == 0) {
+        flush();
+    }
+}
+
+// ためている出力が、指定した遅延に達していれば書き出す
+void FAWStreamOutput::update() {
+    if (!arrivals.empty() && timeout() == 0) {
+        flush();
+    }
+}
+
+void FAWStreamOutput::flush() {
+    if (buffer.empty()) {
+        return;
+    }
+    write_buffer(fp, filename, writeBytesTotal, buffer.data(), buffer.size());
+    fflush(fp.get());
+    buffer.clear();
+    const auto now = std::chrono::steady_clock::now();
+    for (const auto& arrival : arrivals) {
+        const double ms = std::chrono::duration<double, std::milli>(now - arrival).count();
+        latencySum += ms;
+        latencyMax = std::max(latencyMax, ms);
+        count++;
+    }
+    arrivals.clear();
+}
+
+// 次に書き出すまでの時間 (ms) (ためている出力がない場合は-1)
+int FAWStreamOutput::timeout() const {
+    if (arrivals.empty()) {
+        return -1;
+    }
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - arrivals.front()).count();
+    return (int)std::max<int64_t>(0, latency - elapsed);
+}
+
+void FAWStreamOutput::print() const {
+    if (count > 0) {
+        _ftprintf(stderr, _T("latency  avg %.3f ms, max %.3f ms (%llu outputs)\n"), latencySum / count, latencyMax, (unsigned long long)count);
+    }
+}
+
+// FAW mixで出力待ちのエンコード結果
+// 出力した部分は読み出し位置を進めるだけにし、未出力の部分より長くなったときにだけ前に詰める
+struct FAWMixQueue {
+    RGYFAWEncoderOutput out;
+    size_t dataPos; // out.dataのうち出力済みの長さ
+
+    FAWMixQueue() : out(), dataPos(0) {};
+    uint64_t size() const { return out.size() - dataPos; }
+    void push(const RGYFAWEncoderOutput& chunk);
+    const uint8_t *read(const uint64_t offset, const size_t size, std::vector<uint8_t>& tmp) const;
+    void pop(uint64_t size);
+};
+
+// 末尾にchunkを追加する
+void FAWMixQueue::push(const RGYFAWEncoderOutput& chunk) {
+    if (out.data.size() == dataPos && out.zeroTail == 0) {
+        // 0のみの場合は、0の長さだけ加算する
+        out.zeroHead += chunk.zeroHead;
+    } else {
+        out.data.insert(out.data.end(), (size_t)(out.zeroTail + chunk.zeroHead), 0);
+        out.zeroTail = 0;
+    }
+    out.data.insert(out.data.end(), chunk.data.begin(), chunk.data.end());
+    out.zeroTail = chunk.zeroTail;
+}
+
+// offsetからsize byteを返す (0の部分や、長さを超える部分は0としてtmpに展開する)
+const uint8_t *FAWMixQueue::read(const uint64_t offset, const size_t size, std::vector<uint8_t>& tmp) const {
+    const uint8_t *data = out.data.data() + dataPos;
+    const uint64_t dataSize = out.data.size() - dataPos;
+    if (offset >= out.zeroHead && offset + size <= out.zeroHead + dataSize) {
+        return data + (offset - out.zeroHead);
+    }
+    tmp.assign(size, 0);
+    const uint64_t dataStart = std::max(offset, out.zeroHead);
+    const uint64_t dataFin = std::min<uint64_t>(offset + size, out.zeroHead + dataSize);
+    if (dataStart < dataFin) {
+        memcpy(tmp.data() + (dataStart - offset), data + (dataStart - out.zeroHead), (size_t)(dataFin - dataStart));
+    }
+    return tmp.data();
+}
+
+// 先頭からsize byteを削除する
+void FAWMixQueue::pop(uint64_t size) {
+    const auto popZeroHead = std::min(size, out.zeroHead);
+    out.zeroHead -= popZeroHead;
+    size -= popZeroHead;
+    const auto popData = (size_t)std::min<uint64_t>(size, out.data.size() - dataPos);
+    dataPos += popData;
+    const auto remain_bytes = out.data.size() - dataPos;
+    if (remain_bytes == 0) {
+        out.data.clear(); // 確保済みの領域はそのまま使う
+        dataPos = 0;
+    } else if (dataPos >= remain_bytes) {
+        memmove(out.data.data(), out.data.data() + dataPos, remain_bytes);
+        out.data.resize(remain_bytes);
+        dataPos = 0;
+    }
+    size -= popData;
+    out.zeroTail -= std::min(size, out.zeroTail);
+}
+
+// 1つのスレッドが追加し、別の1つのスレッドが取り出す固定長のキュー
+// 各要素は使いまわすので、要素内のバッファは再確保されない
+template<typename T, size_t N>
+class FAWSPSCQueue {
+private:
+    std::array<T, N> slots;
+    std::atomic<size_t> head; // 次に取り出す位置 (取り出し側のみ更新)
+    std::atomic<size_t> tail; // 次に追加する位置 (追加側のみ更新)
+public:
+    FAWSPSCQueue() : slots(), head(0), tail(0) {};
+    // 追加する要素を返す (満杯の場合はnullptr)
+    T *back() {
+        const size_t pos = tail.load(std::memory_order_relaxed);
+        return (pos - head.load(std::memory_order_acquire) < N) ? &slots[pos % N] : nullptr;
+    }
+    // back()で返した要素を追加する
+    void push() { tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+    // 先頭の要素を返す (空の場合はnullptr)
+    T *front() {
+        const size_t pos = head.load(std::memory_order_relaxed);
+        return (pos != tail.load(std::memory_order_acquire)) ? &slots[pos % N] : nullptr;
+    }
+    // front()で返した要素を取り出す
+    void pop() { head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+    // 追加できるまで/取り出せるまで待つ
+    T *wait_back() { return wait([this]() { return back(); }); }
+    T *wait_front() { return wait([this]() { return front(); }); }
+private:
+    // 相手側はすぐに進むことが多いので、しばらくはスレッドを譲るのみとし、
+    // 読み書きを待っている場合など、長く待つ場合は休止する
+    template<typename F>
+    static T *wait(F get) {
+        T *ptr = nullptr;
+        for (int i = 0; (ptr = get()) == nullptr; i++) {
+            if (i < 64) {
+                std::this_thread::yield();
+            } else {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+        return ptr;
+    }
+};
+
+// FAW mixを並列処理する場合に、エンコードスレッドから出力側に渡すデータ
+struct FAWMixChunk {
+    RGYFAWEncoderOutput out;
+    uint64_t readBytes;
+    bool fin; // 最後まで読み取った
+};
+
+// 読み取り・処理・書き込みを別々のスレッドで行う場合に受け渡すデータ
+struct FAWReadChunk {
+    std::vector<uint8_t> buffer;
+    size_t size;
+};
+
+template<typename T>
+struct FAWWriteChunk {
+    T out;
+    bool fin; // 最後の要素 (outは使用しない)
+};
+
+// fpから読み取ったデータをprocessで処理し、その出力をwriteで書き込む
+// 読み取り・書き込みはそれぞれ別のスレッドで行い、キューの要素(バッファ)は使いまわす
+// processは最後に長さ0で呼ばれるので、残りを出力する
+template<typename T>
+static void run_pipeline(FILE *fp, const size_t chunkSize,
+    const std::function<void(T& out, const uint8_t *data, const size_t size)>& process,
+    const std::function<void(T& out)>& write) {
+    FAWSPSCQueue<FAWReadChunk, PIPELINE_QUEUE_SIZE> queueRead;
+    FAWSPSCQueue<FAWWriteChunk<T>, PIPELINE_QUEUE_SIZE> queueWrite;
+    std::thread reader([&]() {
+        for (;;) {
+            FAWReadChunk *chunk = queueRead.wait_back();
+            chunk->buffer.resize(chunkSize);
+            chunk->size = _fread_nolock(chunk->buffer.data(), 1, chunk->buffer.size(), fp);
+            const bool fin = chunk->size == 0;
+            queueRead.push();
+            if (fin) {
+                break;
+            }
+        }
+    });
+    std::thread writer([&]() {
+        for (;;) {
+            FAWWriteChunk<T> *chunk = queueWrite.wait_front();
+            const bool fin = chunk->fin;
+            if (!fin) {
+                write(chunk->out);
+            }
+            queueWrite.pop();
+            if (fin) {
+                break;
+            }
+        }
+    });
+    for (;;) {
+        FAWReadChunk *in = queueRead.wait_front();
+        FAWWriteChunk<T> *out = queueWrite.wait_back();
+        const size_t size = in->size;
+        process(out->out, in->buffer.data(), size);
+        out->fin = false;
+        queueWrite.push();
+        queueRead.pop();
+        if (size == 0) {
+            break;
+        }
+    }
+    queueWrite.wait_back()->fin = true;
+    queueWrite.push();
+    reader.join();
+    writer.join();
+}
+
+// 入力ファイルを読み取り専用でメモリにマップする
+class FAWInputMap {
+private:
+    const uint8_t *ptr;
+    uint64_t length;
+#if defined(_WIN32) || defined(_WIN64)
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+public:
+    FAWInputMap();
+    ~FAWInputMap();
+    bool open(const tstring& filename, const bool hugepage);
+    void close();
+    const uint8_t *data() const { return ptr; }
+    uint64_t size() const { return length; }
+    void prefetch(const uint64_t offset, const uint64_t size);
+    void release(const uint64_t offset, const uint64_t size) const;
+};
+
+FAWInputMap::FAWInputMap() :
+    ptr(nullptr),
+    length(0),
+#if defined(_WIN32) || defined(_WIN64)
+    file(INVALID_HANDLE_VALUE),
+    mapping(NULL) {
+#else
+    fd(-1) {
+#endif
+}
+
+FAWInputMap::~FAWInputMap() {
+    close();
+}
+
+bool FAWInputMap::open(const tstring& filename, const bool hugepage) {
+    close();
+#if defined(_WIN32) || defined(_WIN64)
+    // ファイルのマップではラージページは使用できない
+    file = CreateFile(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    LARGE_INTEGER fileSize = { 0 };
+    if (file == INVALID_HANDLE_VALUE || GetFileType(file) != FILE_TYPE_DISK
+        || !GetFileSizeEx(file, &fileSize) || fileSize.QuadPart <= 0 || (uint64_t)fileSize.QuadPart > (uint64_t)SIZE_MAX) {
+        close();
+        return false;
+    }
+    mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL) {
+        close();
+        return false;
+    }
+    ptr = (const uint8_t *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (ptr == nullptr) {
+        close();
+        return false;
+    }
+    length = (uint64_t)fileSize.QuadPart;
+#else
+    struct stat st = { 0 };
+    fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 || (uint64_t)st.st_size > (uint64_t)SIZE_MAX) {
+        close();
+        return false;
+    }
+    void *map = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        close();
+        return false;
+    }
+    ptr = (const uint8_t *)map;
+    length = (uint64_t)st.st_size;
+    // 先頭から順に1回だけ読むので、先読みを増やし、読んだ部分は早めに解放させる
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    madvise(map, (size_t)length, MADV_SEQUENTIAL);
+#if defined(MADV_HUGEPAGE)
+    if (hugepage) {
+        madvise(map, (size_t)length, MADV_HUGEPAGE); // 対応していない場合は無視される
+    }
+#endif
+#endif
+    return true;
+}
+
+void FAWInputMap::close() {
+#if defined(_WIN32) || defined(_WIN64)
+    if (ptr) {
+        UnmapViewOfFile(ptr);
+    }
+    if (mapping != NULL) {
+        CloseHandle(mapping);
+        mapping = NULL;
+    }
+    if (file != INVALID_HANDLE_VALUE) {
+        CloseHandle(file);
+        file = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (ptr) {
+        munmap((void *)ptr, (size_t)length);
+    }
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+#endif
+    ptr = nullptr;
+    length = 0;
+}
+
+// これから処理する範囲の読み込みを開始させる
+void FAWInputMap::prefetch(const uint64_t offset, const uint64_t size) {
+#if !(defined(_WIN32) || defined(_WIN64))
+    const uint64_t pageSize = (uint64_t)sysconf(_SC_PAGESIZE);
+    const uint64_t start = offset / pageSize * pageSize;
+    const uint64_t fin = std::min(offset + size, length);
+    if (start < fin) {
+        madvise((void *)(ptr + start), (size_t)(fin - start), MADV_WILLNEED);
+    }
+#endif
+}
+
+// 処理済みの範囲をマップから外し、メモリ使用量を抑える (ページキャッシュには残る)
+void FAWInputMap::release(const uint64_t offset, const uint64_t size) const {
+#if !(defined(_WIN32) || defined(_WIN64))
+    const uint64_t pageSize = (uint64_t)sysconf(_SC_PAGESIZE);
+    const uint64_t start = offset / pageSize * pageSize;
+    const uint64_t fin = std::min(offset + size, length);
+    if (start < fin) {
+        madvise((void *)(ptr + start), (size_t)(fin - start), MADV_DONTNEED);
+    }
+#endif
+}
+
+// 出力ファイルに位置を指定して書き込む (複数のスレッドから同時に書き込める)
+class FAWOutputFile {
+private:
+#if defined(_WIN32) || defined(_WIN64)
+    HANDLE file;
+#else
+    int fd;
+#endif
+public:
+    FAWOutputFile();
+    ~FAWOutputFile();
+    bool open(const tstring& filename);
+    void close();
+    bool allocate(const uint64_t size);
+    bool write(const uint8_t *buf, const size_t size, const uint64_t offset);
+};
+
+FAWOutputFile::FAWOutputFile() :
+#if defined(_WIN32) || defined(_WIN64)
+    file(INVALID_HANDLE_VALUE) {
+#else
+    fd(-1) {
+#endif
+}
+
+FAWOutputFile::~FAWOutputFile() {
+    close();
+}
+
+bool FAWOutputFile::open(const tstring& filename) {
+    close();
+#if defined(_WIN32) || defined(_WIN64)
+    file = CreateFile(filename.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE || GetFileType(file) != FILE_TYPE_DISK) {
+        close();
+        return false;
+    }
+#else
+    struct stat st = { 0 };
+    fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close();
+        return false;
+    }
+#endif
+    return true;
+}
+
+void FAWOutputFile::close() {
+#if defined(_WIN32) || defined(_WIN64)
+    if (file != INVALID_HANDLE_VALUE) {
+        CloseHandle(file);
+        file = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+#endif
+}
+
+// ファイルの長さを確定させ、領域を確保する (書き込まない部分は0になる)
+bool FAWOutputFile::allocate(const uint64_t size) {
+#if defined(_WIN32) || defined(_WIN64)
+    LARGE_INTEGER pos;
+    pos.QuadPart = (LONGLONG)size;
+    return SetFilePointerEx(file, pos, NULL, FILE_BEGIN) && SetEndOfFile(file);
+#else
+    if (posix_fallocate(fd, 0, (off_t)size) == 0) {
+        return true;
+    }
+    return ftruncate(fd, (off_t)size) == 0; // 領域の確保に対応していない場合は長さのみ設定する
+#endif
+}
+
+bool FAWOutputFile::write(const uint8_t *buf, const size_t size, const uint64_t offset) {
+    size_t written = 0;
+    while (written < size) {
+#if defined(_WIN32) || defined(_WIN64)
+        OVERLAPPED ov = { 0 };
+        ov.Offset = (DWORD)(offset + written);
+        ov.OffsetHigh = (DWORD)((offset + written) >> 32);
+        DWORD ret = 0;
+        if (!WriteFile(file, buf + written, (DWORD)std::min<size_t>(size - written, 1 << 30), &ret, &ov) || ret == 0) {
+            return false;
+        }
+#else
+        const auto ret = pwrite(fd, buf + written, size - written, (off_t)(offset + written));
+        if (ret <= 0) {
+            return false;
+        }
+#endif
+        written += ret;
+    }
+    return true;
+}
+
+// 処理を終えた範囲をページキャッシュから外し、ほかのプロセスが使っているキャッシュを追い出さないようにする
+// 書き込みの場合は書き出しを開始させておき、1つ前の範囲の書き出しを待ってから外す
+class FAWCacheDrop {
+private:
+    int fd;
+    bool output;
+    uint64_t dropped; // ページキャッシュから外した位置
+    uint64_t flushed; // 書き出しを開始させた位置
+public:
+    FAWCacheDrop();
+    ~FAWCacheDrop();
+    bool open(const tstring& filename, const bool isOutput, const uint64_t start = 0);
+    void close();
+    bool isOpen() const { return fd >= 0; }
+    void advance(const uint64_t pos);
+    void finish();
+private:
+    void flush(const uint64_t start, const uint64_t size, const bool wait);
+};
+
+FAWCacheDrop::FAWCacheDrop() :
+    fd(-1),
+    output(false),
+    dropped(0),
+    flushed(0) {
+}
+
+FAWCacheDrop::~FAWCacheDrop() {
+    close();
+}
+
+// ファイルを別に開いて使う (ページキャッシュはファイルごとなので、読み書きの方法によらず外せる)
+bool FAWCacheDrop::open(const tstring& filename, const bool isOutput, const uint64_t start) {
+    close();
+#if defined(_WIN32) || defined(_WIN64)
+    UNREFERENCED_PARAMETER(filename);
+    UNREFERENCED_PARAMETER(isOutput);
+    UNREFERENCED_PARAMETER(start);
+    return false;
+#else
+    struct stat st = { 0 };
+    if (filename.empty() || is_pipe(filename.c_str())) {
+        return false;
+    }
+    fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close();
+        return false;
+    }
+    output = isOutput;
+    dropped = start;
+    flushed = start;
+    return true;
+#endif
+}
+
+void FAWCacheDrop::close() {
+#if !(defined(_WIN32) || defined(_WIN64))
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+#endif
+}
+
+// startからsize byteの書き出しを開始させる (waitの場合は完了を待つ、sizeが0の場合は末尾まで)
+void FAWCacheDrop::flush(const uint64_t start, const uint64_t size, const bool wait) {
+#if defined(__linux__)
+    sync_file_range(fd, (off64_t)start, (off64_t)size,
+        (wait) ? SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER : SYNC_FILE_RANGE_WRITE);
+#elif !(defined(_WIN32) || defined(_WIN64))
+    if (wait) {
+        fdatasync(fd);
+    }
+#endif
+}
+
+// posまで読み書きを終えた
+void FAWCacheDrop::advance(const uint64_t pos) {
+#if !(defined(_WIN32) || defined(_WIN64))
+    if (fd < 0 || pos < flushed + CACHE_DROP_SIZE) {
+        return;
+    }
+    if (output) {
+        flush(flushed, pos - flushed, false);
+        if (flushed > dropped) {
+            flush(dropped, flushed - dropped, true);
+            posix_fadvise(fd, (off_t)dropped, (off_t)(flushed - dropped), POSIX_FADV_DONTNEED);
+        }
+        dropped = flushed;
+    } else {
+        posix_fadvise(fd, (off_t)dropped, (off_t)(pos - dropped), POSIX_FADV_DONTNEED);
+        dropped = pos;
+    }
+    flushed = pos;
+#else
+    UNREFERENCED_PARAMETER(pos);
+#endif
+}
+
+// 最後まで読み書きを終えたので、ファイル全体を外す (最後に書き換えたwavヘッダも含める)
+void FAWCacheDrop::finish() {
+#if !(defined(_WIN32) || defined(_WIN64))
+    if (fd < 0) {
+        return;
+    }
+    if (output) {
+        flush(0, 0, true);
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+}
+
+// io_uringで読み書きを非同期に発行する (liburingは使用せず、システムコールを直接呼ぶ)
+class FAWUring {
+private:
+#if ENABLE_IO_URING
+    int ringfd;
+    io_uring_params params;
+    uint8_t *sqRing;
+    size_t sqRingSize;
+    uint8_t *cqRing;
+    size_t cqRingSize;
+    io_uring_sqe *sqes;
+#endif
+public:
+    FAWUring();
+    ~FAWUring();
+    static bool available();
+    bool init(const unsigned entries);
+    void close();
+    bool submit(const bool write, const int fd, uint8_t *buf, const size_t size, const uint64_t offset, const uint64_t userdata);
+    bool wait(uint64_t& userdata, int& result);
+};
+
+// io_uringで読み書きするバッファ
+struct FAWUringSlot {
+    std::vector<uint8_t> buffer;
+    uint64_t offset; // ファイル内の位置
+    size_t size;     // 読み書きする長さ
+    int result;      // io_uringで読み書きできた長さ
+    bool busy;       // 完了待ち
+};
+
+// io_uringで入力ファイルを先頭から順に読み取る
+// 各バッファへの読み取りを続けて発行しておき、先頭から順に完了を待って返す
+class FAWUringReader {
+private:
+    FAWUring ring;
+    int fd;
+    uint64_t length;
+    uint64_t submitOffset; // 次に読み取りを発行する位置
+    std::vector<FAWUringSlot> slots;
+    size_t next;  // 次に返すバッファ
+    int returned; // 前回返したバッファ
+    size_t inflight;
+public:
+    FAWUringReader();
+    ~FAWUringReader();
+    bool open(const tstring& filename, const size_t chunkSize, const size_t depth);
+    void close();
+    bool isOpen() const { return fd >= 0; }
+    size_t read(const uint8_t *& ptr);
+private:
+    void submit(const size_t i);
+    bool complete(const size_t i);
+};
+
+FAWUringReader::FAWUringReader() :
+    ring(),
+    fd(-1),
+    length(0),
+    submitOffset(0),
+    slots(),
+    next(0),
+    returned(-1),
+    inflight(0) {
+}
+
+FAWUringReader::~FAWUringReader() {
+    close();
+}
+
+// io_uringで書き込むバッファ
+// 書き込むデータはバッファにまとめてから発行し、書き込み中に次のバッファを埋める
+class FAWUringWriter {
+private:
+    FAWUring ring;
+    int fd;
+    std::vector<FAWUringSlot> slots;
+    size_t current;  // データを追加しているバッファ
+    uint64_t offset; // currentのバッファを書き込む位置
+    size_t inflight;
+    bool error;
+public:
+    FAWUringWriter();
+    ~FAWUringWriter();
+    bool open(const tstring& filename, const size_t bufferSize, const size_t depth);
+    void close();
+    bool isOpen() const { return fd >= 0; }
+    size_t write(const uint8_t *buf, const size_t size);
+    uint64_t writeZero(const uint64_t size);
+    bool flush();
+    bool writeAt(const uint8_t *buf, const size_t size, const uint64_t pos);
+private:
+    void submit();
+    void complete(const size_t i);
+};
+
+FAWUringWriter::FAWUringWriter() :
+    ring(),
+    fd(-1),
+    slots(),
+    current(0),
+    offset(0),
+    inflight(0),
+    error(false) {
+}
+
+FAWUringWriter::~FAWUringWriter() {
+    close();
+}
+
+#if ENABLE_IO_URING
+FAWUring::FAWUring() :
+    ringfd(-1),
+    params(),
+    sqRing(nullptr),
+    sqRingSize(0),
+    cqRing(nullptr),
+    cqRingSize(0),
+    sqes(nullptr) {
+}
+
+FAWUring::~FAWUring() {
+    close();
+}
+
+// io_uringを使用できるか (カーネルが古い場合や、seccompなどで禁止されている場合は使用できない)
+bool FAWUring::available() {
+    FAWUring ring;
+    return ring.init(1);
+}
+
+bool FAWUring::init(const unsigned entries) {
+    close();
+    memset(&params, 0, sizeof(params));
+    ringfd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    // IORING_OP_READ/WRITEは、IORING_FEAT_RW_CUR_POSと同じバージョン(5.6)から使用できる
+    if (ringfd < 0 || (params.features & IORING_FEAT_RW_CUR_POS) == 0) {
+        close();
+        return false;
+    }
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (singleMap) {
+        sqRingSize = std::max(sqRingSize, cqRingSize);
+        cqRingSize = sqRingSize;
+    }
+    void *sq = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        close();
+        return false;
+    }
+    sqRing = (uint8_t *)sq;
+    if (singleMap) {
+        cqRing = sqRing;
+    } else {
+        void *cq = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            close();
+            return false;
+        }
+        cqRing = (uint8_t *)cq;
+    }
+    void *sqe = mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQES);
+    if (sqe == MAP_FAILED) {
+        close();
+        return false;
+    }
+    sqes = (io_uring_sqe *)sqe;
+    return true;
+}
+
+void FAWUring::close() {
+    if (sqes) {
+        munmap(sqes, params.sq_entries * sizeof(io_uring_sqe));
+        sqes = nullptr;
+    }
+    if (cqRing && cqRing != sqRing) {
+        munmap(cqRing, cqRingSize);
+    }
+    cqRing = nullptr;
+    if (sqRing) {
+        munmap(sqRing, sqRingSize);
+        sqRing = nullptr;
+    }
+    if (ringfd >= 0) {
+        ::close(ringfd);
+        ringfd = -1;
+    }
+}
+
+// 読み取り/書き込みを1つ発行する (完了はwait()でuserdataとともに返る)
+bool FAWUring::submit(const bool write, const int fd, uint8_t *buf, const size_t size, const uint64_t offset, const uint64_t userdata) {
+    uint32_t *sqTail = (uint32_t *)(sqRing + params.sq_off.tail);
+    const uint32_t tail = *sqTail;
+    if (tail - __atomic_load_n((uint32_t *)(sqRing + params.sq_off.head), __ATOMIC_ACQUIRE) >= params.sq_entries) {
+        return false;
+    }
+    const uint32_t index = tail & *(uint32_t *)(sqRing + params.sq_off.ring_mask);
+    io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (write) ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)size;
+    sqe->off = offset;
+    sqe->user_data = userdata;
+    ((uint32_t *)(sqRing + params.sq_off.array))[index] = index;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    for (;;) {
+        if (syscall(__NR_io_uring_enter, ringfd, 1, 0, 0, nullptr, 0) == 1) {
+            return true;
+        }
+        if (errno != EINTR) {
+            break;
+        }
+    }
+    // 発行できなかった場合は取り消し、呼び出し側で同期的に読み書きさせる
+    __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+    return false;
+}
+
+// 発行済みの読み取り/書き込みの完了を1つ待つ
+bool FAWUring::wait(uint64_t& userdata, int& result) {
+    uint32_t *cqHead = (uint32_t *)(cqRing + params.cq_off.head);
+    for (;;) {
+        const uint32_t head = *cqHead;
+        if (head != __atomic_load_n((uint32_t *)(cqRing + params.cq_off.tail), __ATOMIC_ACQUIRE)) {
+            const io_uring_cqe *cqe = (const io_uring_cqe *)(cqRing + params.cq_off.cqes) + (head & *(uint32_t *)(cqRing + params.cq_off.ring_mask));
+            userdata = cqe->user_data;
+            result = cqe->res;
+            __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+            return true;
+        }
+        if (syscall(__NR_io_uring_enter, ringfd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR) {
+            return false;
+        }
+    }
+}
+
+bool FAWUringReader::open(const tstring& filename, const size_t chunkSize, const size_t depth) {
+    close();
+    struct stat st = { 0 };
+    fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || !ring.init((unsigned)depth)) {
+        close();
+        return false;
+    }
+    length = (uint64_t)st.st_size;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    slots.resize(depth);
+    for (size_t i = 0; i < slots.size(); i++) {
+        slots[i].buffer.resize(chunkSize);
+        submit(i);
+    }
+    return true;
+}
+
+void FAWUringReader::close() {
+    // 読み取り中のバッファを解放しないよう、完了を待つ
+    uint64_t userdata = 0;
+    int result = 0;
+    while (inflight > 0 && ring.wait(userdata, result)) {
+        inflight--;
+    }
+    inflight = 0;
+    ring.close();
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+    slots.clear();
+    length = 0;
+    submitOffset = 0;
+    next = 0;
+    returned = -1;
+}
+
+// バッファiに続きの読み取りを発行する (発行できない場合は、complete()で読み取る)
+void FAWUringReader::submit(const size_t i) {
+    auto& slot = slots[i];
+    slot.offset = submitOffset;
+    slot.size = (size_t)std::min<uint64_t>(slot.buffer.size(), length - submitOffset);
+    slot.result = 0;
+    slot.busy = false;
+    submitOffset += slot.size;
+    if (slot.size > 0 && ring.submit(false, fd, slot.buffer.data(), slot.size, slot.offset, i)) {
+        slot.busy = true;
+        inflight++;
+    }
+}
+
+// バッファiの読み取りの完了を待つ (読み取れなかった部分はここで読み取る)
+bool FAWUringReader::complete(const size_t i) {
+    while (slots[i].busy) {
+        uint64_t userdata = 0;
+        int result = 0;
+        if (!ring.wait(userdata, result)) {
+            return false;
+        }
+        slots[userdata].result = result;
+        slots[userdata].busy = false;
+        inflight--;
+    }
+    auto& slot = slots[i];
+    size_t readBytes = (size_t)std::max(slot.result, 0);
+    while (readBytes < slot.size) {
+        const auto ret = pread(fd, slot.buffer.data() + readBytes, slot.size - readBytes, (off_t)(slot.offset + readBytes));
+        if (ret <= 0) {
+            return false;
+        }
+        readBytes += ret;
+    }
+    return true;
+}
+
+// 次のデータをptrに返す (前回返したデータは、この呼び出しで次の読み取りに使われる)
+// 最後まで読み取った場合は0を返す
+size_t FAWUringReader::read(const uint8_t *& ptr) {
+    if (returned >= 0) {
+        submit((size_t)returned);
+        returned = -1;
+    }
+    auto& slot = slots[next];
+    if (slot.size == 0 || !complete(next)) {
+        return 0;
+    }
+    ptr = slot.buffer.data();
+    returned = (int)next;
+    next = (next + 1) % slots.size();
+    return slot.size;
+}
+
+bool FAWUringWriter::open(const tstring& filename, const size_t bufferSize, const size_t depth) {
+    close();
+    struct stat st = { 0 };
+    fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || !ring.init((unsigned)depth)) {
+        close();
+        return false;
+    }
+    slots.resize(depth);
+    for (auto& slot : slots) {
+        slot.buffer.resize(bufferSize);
+        slot.offset = 0;
+        slot.size = 0;
+        slot.result = 0;
+        slot.busy = false;
+    }
+    return true;
+}
+
+void FAWUringWriter::close() {
+    uint64_t userdata = 0;
+    int result = 0;
+    while (inflight > 0 && ring.wait(userdata, result)) {
+        inflight--;
+    }
+    inflight = 0;
+    ring.close();
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+    slots.clear();
+    current = 0;
+    offset = 0;
+    error = false;
+}
+
+// データを追加していたバッファの書き込みを発行し、次のバッファに切り替える
+void FAWUringWriter::submit() {
+    auto& slot = slots[current];
+    slot.offset = offset;
+    slot.result = 0;
+    if (ring.submit(true, fd, slot.buffer.data(), slot.size, slot.offset, current)) {
+        slot.busy = true;
+        inflight++;
+    } else {
+        complete(current);
+    }
+    offset += slot.size;
+    current = (current + 1) % slots.size();
+    complete(current);
+}
+
+// バッファiの書き込みの完了を待ち、空にする (書き込めなかった部分はここで書き込む)
+void FAWUringWriter::complete(const size_t i) {
+    while (slots[i].busy) {
+        uint64_t userdata = 0;
+        int result = 0;
+        if (!ring.wait(userdata, result)) {
+            error = true;
+            slots[i].busy = false;
+            break;
+        }
+        slots[userdata].result = result;
+        slots[userdata].busy = false;
+        inflight--;
+    }
+    auto& slot = slots[i];
+    size_t written = (size_t)std::max(slot.result, 0);
+    while (!error && written < slot.size) {
+        const auto ret = pwrite(fd, slot.buffer.data() + written, slot.size - written, (off_t)(slot.offset + written));
+        if (ret <= 0) {
+            error = true;
+            break;
+        }
+        written += ret;
+    }
+    slot.size = 0;
+    slot.result = 0;
+}
+
+size_t FAWUringWriter::write(const uint8_t *buf, const size_t size) {
+    size_t written = 0;
+    while (written < size) {
+        auto& slot = slots[current];
+        const size_t length = std::min(size - written, slot.buffer.size() - slot.size);
+        memcpy(slot.buffer.data() + slot.size, buf + written, length);
+        slot.size += length;
+        written += length;
+        if (slot.size == slot.buffer.size()) {
+            submit();
+        }
+    }
+    return written;
 }
 
-static bool is_pipe(const TCHAR *file) {
-    return file && _tcscmp(file, _T("-")) == 0;
+// 0をsize byte出力する (大きな0の連続は書き込まずに位置だけ進め、flush()でファイルの長さを確定させる)
+uint64_t FAWUringWriter::writeZero(const uint64_t size) {
+    static const std::array<uint8_t, WRITE_ZERO_BUF_SIZE> zero = { 0 };
+    if (size <= zero.size()) {
+        return write(zero.data(), (size_t)size);
+    }
+    if (slots[current].size > 0) {
+        submit();
+    }
+    offset += size;
+    return size;
 }
 
-static std::unique_ptr<FILE, decltype(&fclose)> open_file(const tstring& filename, const bool input) {
-    std::unique_ptr<FILE, decltype(&fclose)>fp(nullptr, fclose);
-    FILE *fptr = nullptr;
-    if (is_pipe(filename.c_str())) {
-        fptr = input ? stdin : stdout;
-#if defined(_WIN32) || defined(_WIN64)
-        if (_setmode(_fileno(fptr), _O_BINARY) < 0) {
-            _ftprintf(stderr, _T("failed to switch %s to binary mode.\n"), input ? _T("stdin") : _T("stdout"));
-            return fp;
-        }
-#endif //#if defined(_WIN32) || defined(_WIN64)
-    } else {
-        if (_tfopen_s(&fptr, filename.c_str(), input ? _T("rb") : _T("wb")) != 0 || fptr == nullptr) {
-            _ftprintf(stderr, _T("failed to open %s file: %s!\n"), input ? _T("input") : _T("output"), filename.c_str());
-            return fp;
-        }
+// 残りのデータを書き込み、すべての書き込みの完了を待つ
+bool FAWUringWriter::flush() {
+    const uint64_t fileLength = offset + slots[current].size;
+    if (slots[current].size > 0) {
+        submit();
     }
-    return std::move(std::unique_ptr<FILE, decltype(&fclose)>(fptr, fclose));
+    for (size_t i = 0; i < slots.size(); i++) {
+        complete(i);
+    }
+    if (ftruncate(fd, (off_t)fileLength) != 0) {
+        error = true;
+    }
+    return !error;
 }
 
-static size_t write_buffer(std::unique_ptr<FILE, decltype(&fclose)>& fp, const tstring& filename, uint64_t& writeBytesTotal, const uint8_t *buf, size_t bufSize) {
-    if (bufSize > 0) {
-        if (!fp) {
-            fp = open_file(filename, false);
+// 位置を指定して書き込む (flush()の後で、wavヘッダを書き換えるのに使用する)
+bool FAWUringWriter::writeAt(const uint8_t *buf, const size_t size, const uint64_t pos) {
+    size_t written = 0;
+    while (!error && written < size) {
+        const auto ret = pwrite(fd, buf + written, size - written, (off_t)(pos + written));
+        if (ret <= 0) {
+            error = true;
+            break;
         }
-        auto written = _fwrite_nolock(buf, 1, bufSize, fp.get());
-        writeBytesTotal += written;
-        return written;
+        written += ret;
     }
-    return 0;
+    return !error;
 }
+#else
+// io_uringを使用できない場合は開けないので、呼び出し側で通常の読み書きを使用する
+FAWUring::FAWUring() {}
+FAWUring::~FAWUring() {}
+bool FAWUring::available() { return false; }
+bool FAWUringReader::open(const tstring&, const size_t, const size_t) { return false; }
+void FAWUringReader::close() {}
+size_t FAWUringReader::read(const uint8_t *&) { return 0; }
+bool FAWUringWriter::open(const tstring&, const size_t, const size_t) { return false; }
+void FAWUringWriter::close() {}
+size_t FAWUringWriter::write(const uint8_t *, const size_t) { return 0; }
+uint64_t FAWUringWriter::writeZero(const uint64_t) { return 0; }
+bool FAWUringWriter::flush() { return false; }
+bool FAWUringWriter::writeAt(const uint8_t *, const size_t, const uint64_t) { return false; }
+#endif
 
 static void write_size(const TCHAR *mes, const uint64_t size, bool CR = false) {
     const TCHAR *unit[5] = { _T("B"), _T("KiB"), _T("MiB"), _T("GiB"), _T("TiB") };
@@ -102,51 +1337,257 @@ static void write_size(const TCHAR *mes, const uint64_t size, bool CR = false) {
     _ftprintf(stderr, _T("%s %10.3f %s%s"), mes, (double)size / (double)(1 << (10 * selectunit)), unit[selectunit], (CR) ? _T("\r") : _T("\n"));
 }
 
-static int run_decode(const RGYFAWMode fawmode, const tstring& input, const std::array<tstring, 2>& output) {
-    auto fp_in = open_file(input, true);
-    if (!fp_in) {
-        return 1;
+// "fawi" chunkがある場合は、indexの各ブロックの位置とchecksumを確認する
+// 確認できた場合は、ブロック数と一致しなかったブロックの数を返す
+static bool verify_block_index(const tstring& input, const RGYFAWMode fawmode, size_t& blocks, size_t& broken) {
+    FAWInputMap inputMap;
+    if (!inputMap.open(input, false) || inputMap.size() < WAVE_HEADER_SIZE) {
+        return false;
     }
-    std::vector<std::unique_ptr<FILE, decltype(&fclose)>> fp_out;
-
-    fp_out.push_back(open_file(output[0], false));
-    if (!fp_out.back()) {
-        return 1;
+    uint64_t indexOffset = 0, dataOffset = 0;
+    uint32_t indexSize = 0, dataSize = 0;
+    if (!RGYWAVHeader::findChunk(inputMap.data(), inputMap.size(), FAW_INDEX_CHUNK_ID, indexOffset, indexSize)
+        || !RGYWAVHeader::findChunk(inputMap.data(), inputMap.size(), "data", dataOffset, dataSize)) {
+        return false;
     }
-    fp_out.push_back(std::unique_ptr<FILE, decltype(&fclose)>(nullptr, fclose));
+    std::vector<RGYFAWBlockIndex> index;
+    if (!rgy_faw_parse_index_chunk(index, inputMap.data() + indexOffset, indexSize)) {
+        _ftprintf(stderr, _T("block index is broken.\n"));
+        return false;
+    }
+    blocks = index.size();
+    broken = rgy_faw_verify_index(index, inputMap.data() + dataOffset, dataSize, fawmode);
+    return true;
+}
 
+static int run_decode(const RGYFAWMode fawmode, const int threads, const int mmapMode, const bool nocache, const int latency, const tstring& input, const std::array<tstring, 2>& output) {
+    // ストリーミング時は、届いたデータから順に処理する
+    const bool stream = latency >= 0;
+    // 通常のファイルは、可能ならマップしてコピーせずにデコーダに渡す
+    FAWInputMap inputMap;
+    const bool use_mmap = !stream && mmapMode > 0 && mmapMode != MMAP_MODE_IO_URING && !is_pipe(input.c_str()) && inputMap.open(input, mmapMode >= 2) && inputMap.size() >= WAVE_HEADER_SIZE;
     const bool use_pipe = is_pipe(input.c_str()) || is_pipe(output[0].c_str()) || is_pipe(output[1].c_str());
 
-    std::vector<uint8_t> buffer((use_pipe) ? 8 * 1024 : 64 * 1024 * 1024);
-    size_t readBytes = _fread_nolock(buffer.data(), 1, buffer.size(), fp_in.get());
-    uint64_t readBytesTotal = readBytes;
+    // 並列処理する場合は、各スレッドに十分なデータを渡せるようにする
+    const size_t chunkSize = (stream) ? STREAM_BUFFER_SIZE
+        : (use_pipe) ? 8 * 1024
+        : std::clamp<size_t>(threads * 16, 64, 1024) * 1024 * 1024;
+
+    // io_uringを使用する場合は、複数の読み取りを先に発行しておく (並列処理する場合は、バッファ全体でchunkSizeとする)
+    FAWUringReader uringIn;
+    const bool use_uring = !stream && !use_mmap && mmapMode == MMAP_MODE_IO_URING && !is_pipe(input.c_str())
+        && uringIn.open(input, (threads <= 1) ? chunkSize : chunkSize / IO_URING_DEPTH, IO_URING_DEPTH);
+    std::unique_ptr<FILE, decltype(&fclose)> fp_in(nullptr, fclose);
+    if (!use_mmap && !use_uring) {
+        fp_in = open_file(input, true);
+        if (!fp_in) {
+            return 1;
+        }
+    }
+
+    // io_uringを使用する場合は、出力もバッファにまとめてから書き込む
+    std::array<FAWUringWriter, 2> uringOut;
+    const bool use_uring_out = !stream && mmapMode == MMAP_MODE_IO_URING && !is_pipe(output[0].c_str())
+        && uringOut[0].open(output[0], IO_URING_WRITE_SIZE, IO_URING_DEPTH);
+    std::vector<std::unique_ptr<FILE, decltype(&fclose)>> fp_out;
+    fp_out.push_back(std::unique_ptr<FILE, decltype(&fclose)>(nullptr, fclose));
+    fp_out.push_back(std::unique_ptr<FILE, decltype(&fclose)>(nullptr, fclose));
+    if (!use_uring_out) {
+        fp_out[0] = open_file(output[0], false);
+        if (!fp_out[0]) {
+            return 1;
+        }
+    }
+    std::vector<uint8_t> buffer((use_mmap || use_uring) ? 0 : chunkSize);
+    uint64_t readBytesTotal = 0;
     uint64_t writeBytesTotal[2] = { 0, 0 };
 
-    RGYFAWDecoderOutput out_buffer;
-    RGYFAWDecoder decoder;
-    const uint32_t wav_header_size = decoder.init(buffer.data());
-    decoder.decode(out_buffer, buffer.data() + wav_header_size, readBytes - wav_header_size);
-    for (int i = 0; i < 2; i++) {
-        write_buffer(fp_out[i], output[i], writeBytesTotal[i], out_buffer[i].data(), out_buffer[i].size());
+    // 処理を終えた範囲は、ページキャッシュから外す
+    FAWCacheDrop dropIn;
+    std::array<FAWCacheDrop, 2> dropOut;
+    if (nocache) {
+        dropIn.open(input, false);
+        dropOut[0].open(output[0], true);
     }
 
-    auto prev = std::chrono::system_clock::now();
-    while ((readBytes = _fread_nolock(buffer.data(), 1, buffer.size(), fp_in.get())) > 0) {
+    // 次に処理するデータを取得する (mmapの場合は、前回の範囲を解放して次の範囲を直接参照する)
+    const uint8_t *readPtr = nullptr;
+    auto read_input = [&]() {
+        size_t readBytes = 0;
+        if (use_mmap) {
+            if (readPtr) {
+                inputMap.release(readPtr - inputMap.data(), chunkSize);
+            }
+            readBytes = (size_t)std::min<uint64_t>(chunkSize, inputMap.size() - readBytesTotal);
+            readPtr = inputMap.data() + readBytesTotal;
+            inputMap.prefetch(readBytesTotal + readBytes, chunkSize);
+        } else if (use_uring) {
+            readBytes = uringIn.read(readPtr);
+        } else {
+            readBytes = _fread_nolock(buffer.data(), 1, buffer.size(), fp_in.get());
+            readPtr = buffer.data();
+        }
+        dropIn.advance(readBytesTotal); // 前回までのデータは処理済み
         readBytesTotal += readBytes;
+        return readBytes;
+    };
+
+    RGYFAWDecoder decoder;
+    decoder.setThreads(threads);
+    auto prev = std::chrono::system_clock::now();
+    auto print_progress = [&]() {
         auto now = std::chrono::system_clock::now();
         if (std::chrono::duration_cast<std::chrono::milliseconds>(now - prev).count() > 500) {
             write_size(_T("Reading"), readBytesTotal, true);
             prev = now;
         }
-        decoder.decode(out_buffer, buffer.data(), readBytes);
+    };
+    auto drop_output = [&](const int i) {
+        if (nocache && i > 0 && !dropOut[i].isOpen() && writeBytesTotal[i] > 0) {
+            dropOut[i].open(output[i], true);
+        }
+        dropOut[i].advance(writeBytesTotal[i]);
+    };
+    auto write_output = [&](RGYFAWDecoderOutput& out) {
+        for (int i = 0; i < 2; i++) {
+            // 2つ目の出力は、出力するデータがある場合にのみ作成する
+            if (use_uring_out && out[i].size() > 0 && !fp_out[i]
+                && (uringOut[i].isOpen() || uringOut[i].open(output[i], IO_URING_WRITE_SIZE, IO_URING_DEPTH))) {
+                writeBytesTotal[i] += uringOut[i].write(out[i].data(), out[i].size());
+            } else {
+                write_buffer(fp_out[i], output[i], writeBytesTotal[i], out[i].data(), out[i].size());
+            }
+            drop_output(i);
+        }
+    };
+
+    if (stream) {
+        // 届いた分だけ読み取ってデコードし、出力は指定した遅延以内に書き出す
+        std::vector<FAWStreamOutput> streamOut;
+        for (int i = 0; i < 2; i++) {
+            streamOut.emplace_back(fp_out[i], output[i], writeBytesTotal[i], latency);
+        }
+        std::vector<uint8_t> header;
+        RGYFAWDecoderOutput out_buffer;
+        for (;;) {
+            int timeout = -1;
+            for (const auto& s : streamOut) {
+                const int t = s.timeout();
+                timeout = (timeout < 0) ? t : (t < 0) ? timeout : std::min(timeout, t);
+            }
+            const int64_t readBytes = stream_read(fp_in.get(), buffer.data(), buffer.size(), timeout);
+            if (readBytes < 0) {
+                break;
+            }
+            const auto arrival = std::chrono::steady_clock::now();
+            if (readBytes > 0) {
+                dropIn.advance(readBytesTotal);
+                readBytesTotal += readBytes;
+                const uint8_t *data = buffer.data();
+                size_t size = (size_t)readBytes;
+                // wavヘッダがそろうまではためておく
+                if (header.size() < WAVE_HEADER_SIZE) {
+                    const size_t length = std::min<size_t>(WAVE_HEADER_SIZE - header.size(), size);
+                    header.insert(header.end(), data, data + length);
+                    data += length;
+                    size -= length;
+                    if (header.size() < WAVE_HEADER_SIZE) {
+                        continue;
+                    }
+                    decoder.init(header.data());
+                }
+                decoder.decode(out_buffer, data, size);
+                for (int i = 0; i < 2; i++) {
+                    streamOut[i].write(out_buffer[i].data(), out_buffer[i].size(), arrival);
+                }
+                print_progress();
+            }
+            for (int i = 0; i < 2; i++) {
+                streamOut[i].update();
+                drop_output(i);
+            }
+        }
+        if (header.size() < WAVE_HEADER_SIZE) {
+            _ftprintf(stderr, _T("input file is too short: %s!\n"), input.c_str());
+            return 1;
+        }
+        decoder.fin(out_buffer);
+        const auto arrival = std::chrono::steady_clock::now();
         for (int i = 0; i < 2; i++) {
-            write_buffer(fp_out[i], output[i], writeBytesTotal[i], out_buffer[i].data(), out_buffer[i].size());
+            streamOut[i].write(out_buffer[i].data(), out_buffer[i].size(), arrival);
+            streamOut[i].flush();
+            drop_output(i);
+        }
+        for (const auto& s : streamOut) {
+            s.print();
+        }
+    } else if (threads > 1 && !use_mmap && !use_uring) {
+        // 読み取り・デコード・書き込みを別々のスレッドで行い、入出力とデコードを同時に進める
+        // キューにある分だけバッファが増えるので、1回に読み取る長さはその分小さくする
+        bool first = true;
+        bool tooShort = false;
+        run_pipeline<RGYFAWDecoderOutput>(fp_in.get(), std::max<size_t>(chunkSize / PIPELINE_QUEUE_SIZE, WAVE_HEADER_SIZE),
+            [&](RGYFAWDecoderOutput& out, const uint8_t *data, const size_t size) {
+                dropIn.advance(readBytesTotal);
+                readBytesTotal += size;
+                if (size == 0) {
+                    if (!tooShort) {
+                        decoder.fin(out);
+                    }
+                    return;
+                }
+                if (first) {
+                    first = false;
+                    tooShort = size < WAVE_HEADER_SIZE;
+                    if (!tooShort) {
+                        const uint32_t wav_header_size = decoder.init(data);
+                        decoder.decode(out, data + wav_header_size, size - wav_header_size);
+                    }
+                    return;
+                }
+                print_progress();
+                if (!tooShort) {
+                    decoder.decode(out, data, size);
+                }
+            },
+            write_output);
+        if (tooShort || first) {
+            _ftprintf(stderr, _T("input file is too short: %s!\n"), input.c_str());
+            return 1;
+        }
+    } else {
+        size_t readBytes = read_input();
+        if (readBytes < WAVE_HEADER_SIZE) {
+            _ftprintf(stderr, _T("input file is too short: %s!\n"), input.c_str());
+            return 1;
+        }
+        RGYFAWDecoderOutput out_buffer;
+        const uint32_t wav_header_size = decoder.init(readPtr);
+        decoder.decode(out_buffer, readPtr + wav_header_size, readBytes - wav_header_size);
+        write_output(out_buffer);
+
+        while ((readBytes = read_input()) > 0) {
+            print_progress();
+            decoder.decode(out_buffer, readPtr, readBytes);
+            write_output(out_buffer);
         }
+        decoder.fin(out_buffer);
+        write_output(out_buffer);
     }
-    decoder.fin(out_buffer);
+    // ページキャッシュから外す前に、"fawi" chunkがあればブロックを確認しておく
+    size_t indexBlocks = 0, indexBroken = 0;
+    const bool indexVerified = !stream && !is_pipe(input.c_str()) && verify_block_index(input, decoder.mode(), indexBlocks, indexBroken);
     for (int i = 0; i < 2; i++) {
-        write_buffer(fp_out[i], output[i], writeBytesTotal[i], out_buffer[i].data(), out_buffer[i].size());
+        if (uringOut[i].isOpen() && !uringOut[i].flush()) {
+            _ftprintf(stderr, _T("failed to write output file: %s!\n"), output[i].c_str());
+            return 1;
+        }
+        if (fp_out[i]) {
+            fflush(fp_out[i].get());
+        }
+        dropOut[i].finish();
     }
+    dropIn.finish();
     _ftprintf(stderr, _T("\nFinished\n"));
     write_size(_T("read    "), readBytesTotal);
     for (int i = 0; i < 2; i++) {
@@ -154,22 +1595,32 @@ static int run_decode(const RGYFAWMode fawmode, const tstring& input, const std:
             write_size(_T("written"), writeBytesTotal[i]);
         }
     }
+    if (indexVerified) {
+        _ftprintf(stderr, _T("block index %llu blocks, %llu broken\n"), (unsigned long long)indexBlocks, (unsigned long long)indexBroken);
+    }
     return 0;
 }
 
 struct FAWEncode {
     FILE *fpin;
+    FAWUringReader uring; // io_uringを使用する場合はfpinの代わりに使用する
+    FAWCacheDrop drop;
+    uint64_t inputPos;    // 読み取った位置
     std::vector<uint8_t> buffer;
-    std::vector<uint8_t> out_buffer;
-    std::vector<uint8_t> out_tmp;
+    RGYFAWEncoderOutput out_buffer;
+    FAWMixQueue out_tmp;
     RGYFAWEncoder encoder;
     uint64_t readBytesTotal;
     FAWEncode();
-    void init(FILE *fp, const RGYWAVHeader& wavheader, const bool use_pipe, const RGYFAWMode fawmode, const int delay);
+    void init(FILE *fp, const RGYWAVHeader& wavheader, const size_t readSize, const RGYFAWMode fawmode, const int delay);
+    size_t read(const uint8_t *& ptr);
 };
 
 FAWEncode::FAWEncode() :
     fpin(nullptr),
+    uring(),
+    drop(),
+    inputPos(0),
     buffer(),
     out_buffer(),
     out_tmp(),
@@ -178,99 +1629,403 @@ FAWEncode::FAWEncode() :
 
 }
 
-void FAWEncode::init(FILE *fp, const RGYWAVHeader& wavheader, const bool use_pipe, const RGYFAWMode fawmode, const int delay) {
+void FAWEncode::init(FILE *fp, const RGYWAVHeader& wavheader, const size_t readSize, const RGYFAWMode fawmode, const int delay) {
     fpin = fp;
-    buffer.resize((use_pipe) ? 8 * 1024 : 4 * 1024 * 1024);
+    buffer.resize((uring.isOpen()) ? 0 : readSize);
     encoder.init(&wavheader, fawmode, delay);
     readBytesTotal = 0;
+    inputPos = 0;
 }
 
-static int run_encode(const RGYFAWMode fawmode, const std::array<int, 2>& delay, const std::array<tstring, 2>& input, const tstring& output) {
-    std::vector<std::unique_ptr<FILE, decltype(&fclose)>> fp_in;
-    for (auto& in : input) {
-        if (!in.empty()) {
-            auto fp = open_file(in, true);
-            if (!fp) {
-                return 0;
+// 次のデータを読み取ってptrに返す (io_uringの場合は、読み取り済みのバッファをそのまま返す)
+size_t FAWEncode::read(const uint8_t *& ptr) {
+    drop.advance(inputPos); // 前回までのデータは処理済み
+    size_t readBytes = 0;
+    if (uring.isOpen()) {
+        readBytes = uring.read(ptr);
+    } else {
+        ptr = buffer.data();
+        readBytes = _fread_nolock(buffer.data(), 1, buffer.size(), fpin);
+    }
+    inputPos += readBytes;
+    return readBytes;
+}
+
+// data chunkの後ろに出力する"fawi" chunkを作成する (data chunkが奇数長の場合は、先頭に1byteの0を入れる)
+// wavヘッダの長さが4GBを超える場合はchunkを探せないので、作成しない
+static std::vector<uint8_t> create_index_trailer(std::vector<RGYFAWBlockIndex>& index, const uint64_t dataSize) {
+    const uint64_t trailerSize = (dataSize & 1) + 8 + index.size() * FAW_INDEX_ENTRY_SIZE;
+    if (WAVE_HEADER_SIZE - 8 + dataSize + trailerSize > std::numeric_limits<uint32_t>::max()) {
+        _ftprintf(stderr, _T("output is too large to add block index.\n"));
+        return std::vector<uint8_t>();
+    }
+    std::sort(index.begin(), index.end(), [](const RGYFAWBlockIndex& a, const RGYFAWBlockIndex& b) {
+        return (a.offset != b.offset) ? a.offset < b.offset : a.track < b.track;
+    });
+    std::vector<uint8_t> trailer(dataSize & 1, 0);
+    const auto chunk = rgy_faw_create_index_chunk(index);
+    trailer.insert(trailer.end(), chunk.begin(), chunk.end());
+    return trailer;
+}
+
+// 入力全体をマップし、出力するブロックの位置を先に求めてから、複数のスレッドで出力ファイルの各位置に書き込む
+static int run_encode_parallel(const RGYFAWMode fawmode, const int threads, const bool writeIndex, const bool nocache, const int delay, const tstring& input, const FAWInputMap& inputMap, const tstring& output) {
+    FAWOutputFile fp_out;
+    if (!fp_out.open(output)) {
+        _ftprintf(stderr, _T("failed to open output file: %s!\n"), output.c_str());
+        return 1;
+    }
+
+    RGYWAVHeader wavheaderInput = { 0 };
+    wavheaderInput.init(2, 48000, (fawmode == RGYFAWMode::Full) ? sizeof(short) : sizeof(char), 0);
+    RGYFAWEncoder encoder;
+    encoder.init(&wavheaderInput, fawmode, delay);
+    std::vector<RGYFAWEncodeBlock> blocks;
+    const uint64_t outputLength = encoder.layout(blocks, inputMap.data(), (size_t)inputMap.size());
+    std::vector<RGYFAWBlockIndex> index((writeIndex) ? blocks.size() : 0);
+
+    // wavヘッダと4byteの0のあとに出力する
+    const uint64_t outputOffset = WAVE_HEADER_SIZE + 4;
+    if (!fp_out.allocate(outputOffset + outputLength)) {
+        _ftprintf(stderr, _T("failed to allocate output file: %s!\n"), output.c_str());
+        return 1;
+    }
+
+    // 各スレッドは連続するブロックを担当し、ある程度まとめてから書き込む
+    // ブロック間は0なので、間隔が大きい場合(遅延など)は書き込まない
+    // 書き込みに失敗したら、他のスレッドも処理を打ち切る
+    std::atomic<bool> writeError(false);
+    const size_t nthreads = std::max<size_t>(1, std::min<size_t>(threads, blocks.size()));
+    std::vector<std::thread> workers;
+    for (size_t ithread = 0; ithread < nthreads; ithread++) {
+        workers.emplace_back([&, ithread]() {
+            const size_t blockStart = blocks.size() * ithread / nthreads;
+            const size_t blockFin = blocks.size() * (ithread + 1) / nthreads;
+            // 各スレッドは担当する範囲を先頭から順に読み書きするので、処理を終えた範囲をページキャッシュから外す
+            FAWCacheDrop dropIn, dropOut;
+            if (nocache && blockStart < blockFin) {
+                dropIn.open(input, false, blocks[blockStart].pos);
+                dropOut.open(output, true, outputOffset + blocks[blockStart].outputPos);
             }
-            fp_in.push_back(std::move(fp));
-        }
+            std::vector<uint8_t> buffer;
+            for (size_t i = blockStart; i < blockFin && !writeError; ) {
+                const uint64_t writeStart = blocks[i].outputPos;
+                uint64_t writeFin = writeStart;
+                size_t j = i;
+                for (; j < blockFin && (j == i || (blocks[j].padding < WRITE_ZERO_BUF_SIZE && writeFin - writeStart < ENCODE_WRITE_SIZE)); j++) {
+                    writeFin = blocks[j].outputPos + fawstart1.size() + blocks[j].size + 4 /*checksum*/ + fawfin1.size();
+                }
+                buffer.assign((size_t)(writeFin - writeStart), 0);
+                encoder.writeBlocks(buffer.data(), inputMap.data(), blocks.data() + i, j - i, (writeIndex) ? index.data() + i : nullptr);
+                // 最終出力は4byte少ないことがあるので、出力全体の長さを超えないようにする
+                const size_t writeLength = (size_t)(std::min(writeFin, outputLength) - std::min(writeStart, outputLength));
+                if (writeLength > 0 && !fp_out.write(buffer.data(), writeLength, outputOffset + writeStart)) {
+                    writeError = true;
+                    break;
+                }
+                if (dropIn.isOpen()) {
+                    // マップしている部分はページキャッシュから外せないので、先にマップから外す
+                    const uint64_t inputFin = blocks[j - 1].pos + blocks[j - 1].size;
+                    inputMap.release(blocks[i].pos, inputFin - blocks[i].pos);
+                    dropIn.advance(inputFin);
+                }
+                dropOut.advance(outputOffset + writeFin);
+                i = j;
+            }
+        });
+    }
+    for (auto& th : workers) {
+        th.join();
+    }
+    if (writeError) {
+        _ftprintf(stderr, _T("failed to write output file: %s!\n"), output.c_str());
+        return 1;
     }
 
-    auto fp_out = open_file(output, false);
-    if (!fp_out) {
+    // wavヘッダは最後に書き込む (その後ろの4byteの0は確保時に0になっている)
+    RGYWAVHeader wavheader = { 0 };
+    wavheader.init(2, 48000, (fawmode == RGYFAWMode::Half) ? sizeof(char) : sizeof(short), 0);
+    wavheader.data_size = (decltype(wavheader.data_size))std::min<uint64_t>(outputOffset + outputLength - WAVE_HEADER_SIZE, std::numeric_limits<decltype(wavheader.data_size)>::max());
+    uint64_t writeBytesTotal = outputOffset + outputLength;
+    if (writeIndex) {
+        for (auto& entry : index) {
+            entry.offset += 4;
+        }
+        const auto trailer = create_index_trailer(index, outputOffset + outputLength - WAVE_HEADER_SIZE);
+        if (!fp_out.write(trailer.data(), trailer.size(), writeBytesTotal)) {
+            _ftprintf(stderr, _T("failed to write output file: %s!\n"), output.c_str());
+            return 1;
+        }
+        wavheader.extra_size = (uint32_t)trailer.size();
+        writeBytesTotal += trailer.size();
+    }
+    std::vector<uint8_t> wavheaderBytes = wavheader.createHeader();
+    if (!fp_out.write(wavheaderBytes.data(), wavheaderBytes.size(), 0)) {
+        _ftprintf(stderr, _T("failed to write output file: %s!\n"), output.c_str());
         return 1;
     }
+    if (nocache) {
+        FAWCacheDrop dropIn, dropOut;
+        if (dropIn.open(input, false)) {
+            inputMap.release(0, inputMap.size());
+            dropIn.finish();
+        }
+        if (dropOut.open(output, true)) {
+            dropOut.finish();
+        }
+    }
+
+    _ftprintf(stderr, _T("\nFinished\n"));
+    write_size(_T("read    "), inputMap.size());
+    write_size(_T("written"), writeBytesTotal);
+    return 0;
+}
+
+// 入力のADTSヘッダをたどり、出力されるwavのdata部分の長さを求める (入力がパイプの場合は求められないので0を返す)
+static uint64_t measure_encode_output(const RGYFAWMode fawmode, const std::array<int, 2>& delay, const std::array<tstring, 2>& input) {
+    const bool mix = !input[1].empty();
+    uint64_t outputLength = 0;
+    for (size_t ifile = 0; ifile < input.size(); ifile++) {
+        if (input[ifile].empty()) {
+            continue;
+        }
+        if (is_pipe(input[ifile].c_str())) {
+            return 0;
+        }
+        // 空のファイルはマップできないので、長さ0の入力として扱う
+        static const uint8_t empty = 0;
+        std::error_code ec;
+        const bool isEmpty = std::filesystem::is_regular_file(input[ifile], ec) && std::filesystem::file_size(input[ifile], ec) == 0;
+        FAWInputMap inputMap;
+        if (!isEmpty && !inputMap.open(input[ifile], false)) {
+            return 0;
+        }
+        RGYWAVHeader wavheaderInput = { 0 };
+        wavheaderInput.init(2, 48000, (fawmode == RGYFAWMode::Full) ? sizeof(short) : sizeof(char), 0);
+        RGYFAWEncoder encoder;
+        encoder.init(&wavheaderInput, (mix) ? RGYFAWMode::Half : fawmode, delay[ifile]);
+        uint64_t encodeLength = 0;
+        const uint64_t totalLength = encoder.measure((isEmpty) ? &empty : inputMap.data(), (size_t)inputMap.size(), &encodeLength);
+        // FAW mixでは、fin()の出力は使用せず、長いほうに合わせて16bitにする
+        outputLength = std::max(outputLength, (mix) ? encodeLength * sizeof(uint16_t) : totalLength);
+    }
+    return 4 /*先頭の4byteの0*/ + outputLength;
+}
+
+static int run_encode(const RGYFAWMode fawmode, const int threads, const int mmapMode, const bool writeIndex, const bool nocache, const int latency, const std::array<int, 2>& delay, const std::array<tstring, 2>& input, const tstring& output) {
+    // ストリーミング時は、届いたデータから順に処理する (FAW mixでは、2つの入力の進み具合に依存するので行わない)
+    const bool stream = latency >= 0 && input[1].empty();
+    if (latency >= 0 && !stream) {
+        _ftprintf(stderr, _T("streaming mode is not supported with FAW mix.\n"));
+    }
+
+    // 1つのaacを複数スレッドで処理する場合は、入力全体をマップして並列に出力する
+    if (!stream && threads > 1 && input[1].empty() && mmapMode > 0 && mmapMode != MMAP_MODE_IO_URING && !is_pipe(input[0].c_str()) && !is_pipe(output.c_str())) {
+        FAWInputMap inputMap;
+        if (inputMap.open(input[0], mmapMode >= 2)) {
+            return run_encode_parallel(fawmode, threads, writeIndex, nocache, delay[0], input[0], inputMap, output);
+        }
+    }
 
     const bool use_pipe = is_pipe(input[0].c_str()) || is_pipe(input[1].c_str()) || is_pipe(output.c_str());
+    // FAW mixの場合は、1回の読み取りで先に進む量を抑え、出力待ちの長さを小さくする
+    const size_t readSize = (stream) ? STREAM_BUFFER_SIZE : (use_pipe) ? 8 * 1024 : (!input[1].empty()) ? ENCODE_MIX_READ_SIZE : ENCODE_READ_SIZE;
+
+    std::vector<FAWEncode> reader((input[1].empty()) ? 1 : 2);
+    std::vector<std::unique_ptr<FILE, decltype(&fclose)>> fp_in;
+    for (size_t ifile = 0; ifile < reader.size(); ifile++) {
+        // io_uringを使用する場合は、複数の読み取りを先に発行しておく
+        if (!stream && mmapMode == MMAP_MODE_IO_URING && !is_pipe(input[ifile].c_str())
+            && reader[ifile].uring.open(input[ifile], readSize, IO_URING_DEPTH)) {
+            fp_in.push_back(std::unique_ptr<FILE, decltype(&fclose)>(nullptr, fclose));
+            continue;
+        }
+        auto fp = open_file(input[ifile], true);
+        if (!fp) {
+            return 0;
+        }
+        fp_in.push_back(std::move(fp));
+    }
+    if (nocache) {
+        for (size_t ifile = 0; ifile < reader.size(); ifile++) {
+            reader[ifile].drop.open(input[ifile], false);
+        }
+    }
+
+    // io_uringを使用する場合は、出力をバッファにまとめてから書き込む
+    FAWUringWriter uringOut;
+    const bool use_uring_out = !stream && mmapMode == MMAP_MODE_IO_URING && !is_pipe(output.c_str())
+        && uringOut.open(output, IO_URING_WRITE_SIZE, IO_URING_DEPTH);
+    std::unique_ptr<FILE, decltype(&fclose)> fp_out(nullptr, fclose);
+    if (!use_uring_out) {
+        fp_out = open_file(output, false);
+        if (!fp_out) {
+            return 1;
+        }
+    }
+
+    FAWCacheDrop dropOut;
+    if (nocache) {
+        dropOut.open(output, true);
+    }
+
+    if (writeIndex && is_pipe(output.c_str())) {
+        _ftprintf(stderr, _T("block index is not supported with pipe output.\n"));
+    }
 
     uint64_t writeBytesTotal = 0;
+    auto write_data = [&](const uint8_t *buf, const size_t size) {
+        if (use_uring_out) {
+            writeBytesTotal += uringOut.write(buf, size);
+        } else {
+            write_buffer(fp_out, output, writeBytesTotal, buf, size);
+        }
+        dropOut.advance(writeBytesTotal);
+    };
+    auto write_encoded = [&](RGYFAWEncoderOutput& out) {
+        if (use_uring_out) {
+            writeBytesTotal += uringOut.writeZero(out.zeroHead);
+            writeBytesTotal += uringOut.write(out.data.data(), out.data.size());
+            writeBytesTotal += uringOut.writeZero(out.zeroTail);
+            out.clear();
+        } else {
+            write_encoder_output(fp_out, output, writeBytesTotal, out);
+        }
+        dropOut.advance(writeBytesTotal);
+    };
 
     RGYWAVHeader wavheader = { 0 };
     wavheader.init(2, 48000, (fawmode == RGYFAWMode::Half) ? sizeof(char) : sizeof(short), 0);
+    // 出力がパイプの場合は最後にwavヘッダを書き換えられないので、先に入力全体から出力の長さを求めておく
+    if (is_pipe(output.c_str())) {
+        wavheader.data_size = (decltype(wavheader.data_size))std::min<uint64_t>(measure_encode_output(fawmode, delay, input), std::numeric_limits<decltype(wavheader.data_size)>::max());
+    }
     {
         std::vector<uint8_t> wavheaderBytes = wavheader.createHeader();
-        write_buffer(fp_out, output, writeBytesTotal, wavheaderBytes.data(), wavheaderBytes.size());
+        write_data(wavheaderBytes.data(), wavheaderBytes.size());
         // 4byte 0 で埋める (FAWは必ずこうなっている模様)
         std::vector<uint8_t> zero4(4, 0);
-        write_buffer(fp_out, output, writeBytesTotal, zero4.data(), zero4.size());
+        write_data(zero4.data(), zero4.size());
     }
 
-    std::vector<FAWEncode> reader(fp_in.size());
-    for (size_t ifile = 0; ifile < fp_in.size(); ifile++) {
+    for (size_t ifile = 0; ifile < reader.size(); ifile++) {
         // FAW Mixの場合、wavheaderInputはwavheaderと異なる (elemsizeが異なる)
         RGYWAVHeader wavheaderInput = { 0 };
         wavheaderInput.init(2, 48000, (fawmode == RGYFAWMode::Full) ? sizeof(short) : sizeof(char), 0);
-        reader[ifile].init(fp_in[ifile].get(), wavheaderInput, use_pipe, (fp_in.size() > 1) ? RGYFAWMode::Half : fawmode, delay[ifile]);
+        reader[ifile].init(fp_in[ifile].get(), wavheaderInput, readSize, (reader.size() > 1) ? RGYFAWMode::Half : fawmode, delay[ifile]);
+        reader[ifile].encoder.setIndex(writeIndex);
     }
 
     if (reader.size() == 2) { // FAW mix
         std::vector<uint8_t> outfawmix;
-
-        auto prev = std::chrono::system_clock::now();
-        for (;;) {
-            bool bothEOF = true;
+        std::array<std::vector<uint8_t>, 2> zero_tmp;
+        const auto funcMergeMix = get_merge_audio_8x2to16_func();
+        // 各音声の先頭からprocess_data byteをFAW mixで出力する
+        // 0の部分は一定の長さずつ展開しながら出力する
+        auto write_mix = [&](const uint64_t process_data) {
+            for (uint64_t offset = 0; offset < process_data; offset += WRITE_MIX_SIZE) {
+                const size_t length = (size_t)std::min<uint64_t>(WRITE_MIX_SIZE, process_data - offset);
+                outfawmix.resize(length * sizeof(uint16_t));
+                const uint8_t *out_tmp0 = reader[0].out_tmp.read(offset, length, zero_tmp[0]);
+                const uint8_t *out_tmp1 = reader[1].out_tmp.read(offset, length, zero_tmp[1]);
+                funcMergeMix((uint16_t *)outfawmix.data(), out_tmp0, out_tmp1, length);
+                write_data(outfawmix.data(), outfawmix.size());
+            }
+            // 出力した部分を削除
             for (auto& r : reader) {
-                const size_t readBytes = _fread_nolock(r.buffer.data(), 1, r.buffer.size(), r.fpin);
-                r.readBytesTotal += readBytes;
-                bothEOF &= readBytes == 0;
-                if (readBytes > 0) {
-                    r.encoder.encode(r.out_buffer, r.buffer.data(), readBytes);
-                    // out_tmp のほうに移動
-                    const auto tmpsize = r.out_tmp.size();
-                    if (r.out_buffer.size() > 0) {
-                        r.out_tmp.resize(tmpsize + r.out_buffer.size());
-                        memcpy(r.out_tmp.data() + tmpsize, r.out_buffer.data(), r.out_buffer.size());
-                        r.out_buffer.clear();
-                    }
+                r.out_tmp.pop(process_data);
+            }
+        };
+
+        // 読み取りを終えた音声は0で埋めるので、読み取り中の音声のうち短いほうに合わせて出力する
+        // 両方読み取りを終えたら、長いほうに合わせる
+        std::array<bool, 2> finished = { false, false };
+        auto writable_size = [&]() {
+            uint64_t size_min = std::numeric_limits<uint64_t>::max();
+            uint64_t size_max = 0;
+            for (size_t i = 0; i < reader.size(); i++) {
+                size_max = std::max(size_max, reader[i].out_tmp.size());
+                if (!finished[i]) {
+                    size_min = std::min(size_min, reader[i].out_tmp.size());
                 }
             }
-            if (bothEOF) { // 両ファイル最後まで読み取ったら抜ける
-                break;
+            return (finished[0] && finished[1]) ? size_max : size_min;
+        };
+
+        // 最後まで処理 (FAW mixではfin()の出力は使用しないので、ブロックの位置も記録しない)
+        auto fin_mix = [](FAWEncode& r) {
+            r.encoder.setIndex(false);
+            r.encoder.fin(r.out_buffer);
+        };
+
+        // 並列処理する場合は、音声ごとのスレッドで読み取り・エンコードを行い、
+        // このスレッドはFAW mixの作成と書き込みのみを行う
+        const bool use_thread = threads > 1;
+        std::array<FAWSPSCQueue<FAWMixChunk, ENCODE_MIX_QUEUE_SIZE>, 2> queue;
+        std::vector<std::thread> workers;
+        if (use_thread) {
+            for (size_t i = 0; i < reader.size(); i++) {
+                workers.emplace_back([&, i]() {
+                    auto& r = reader[i];
+                    for (;;) {
+                        FAWMixChunk *chunk = queue[i].wait_back();
+                        chunk->out.clear();
+                        const uint8_t *data = nullptr;
+                        chunk->readBytes = r.read(data);
+                        chunk->fin = chunk->readBytes == 0;
+                        if (chunk->fin) {
+                            fin_mix(r);
+                        } else {
+                            r.encoder.encode(chunk->out, data, chunk->readBytes);
+                        }
+                        queue[i].push();
+                        if (chunk->fin) {
+                            break;
+                        }
+                    }
+                });
             }
+        }
 
-            // 短いほうに合わせる
-            const auto process_data = std::min(reader[0].out_tmp.size(), reader[1].out_tmp.size());
-            // FAW mixで出力
-            outfawmix.resize(process_data * sizeof(uint16_t));
-            uint16_t *const ptr_mix = (uint16_t *)outfawmix.data();
-            const uint8_t *out_tmp0 = reader[0].out_tmp.data();
-            const uint8_t *out_tmp1 = reader[1].out_tmp.data();
-            for (size_t i = 0; i < process_data; i++) {
-                const uint8_t v0 = out_tmp0[i] - 128;
-                const uint8_t v1 = out_tmp1[i] - 128;
-                ptr_mix[i] = ((((uint16_t)v0) << 8) | (uint16_t)v1);
+        // 音声targetの続きをout_tmpの末尾に追加し、最後まで読み取った場合はfalseを返す
+        auto encode_next = [&](const int target) {
+            auto& r = reader[target];
+            if (use_thread) {
+                FAWMixChunk *chunk = queue[target].wait_front();
+                const bool fin = chunk->fin;
+                r.readBytesTotal += chunk->readBytes;
+                r.out_tmp.push(chunk->out);
+                queue[target].pop();
+                return !fin;
+            }
+            const uint8_t *data = nullptr;
+            const size_t readBytes = r.read(data);
+            r.readBytesTotal += readBytes;
+            if (readBytes == 0) {
+                fin_mix(r);
+                return false;
             }
-            write_buffer(fp_out, output, writeBytesTotal, outfawmix.data(), outfawmix.size());
+            // out_tmp の末尾に直接出力する
+            r.encoder.encode(r.out_tmp.out, data, readBytes);
+            return true;
+        };
 
-            // 出力した部分を削除
-            for (auto& r : reader) {
-                const auto remain_bytes = r.out_tmp.size() - process_data;
-                if (remain_bytes > 0) {
-                    memmove(r.out_tmp.data(), r.out_tmp.data() + process_data, remain_bytes);
+        auto prev = std::chrono::system_clock::now();
+        for (;;) {
+            // 出力が遅れているほうから読み取り、もう一方の出力待ちがたまらないようにする
+            int target = -1;
+            for (int i = 0; i < (int)reader.size(); i++) {
+                if (!finished[i] && (target < 0 || reader[i].out_tmp.size() < reader[target].out_tmp.size())) {
+                    target = i;
                 }
-                r.out_tmp.resize(remain_bytes);
             }
+            if (target < 0) { // 両ファイル最後まで読み取ったら抜ける
+                break;
+            }
+            if (!encode_next(target)) {
+                finished[target] = true;
+            }
+            write_mix(writable_size());
 
             // 進捗表示
             auto now = std::chrono::system_clock::now();
@@ -279,38 +2034,85 @@ static int run_encode(const RGYFAWMode fawmode, const std::array<int, 2>& delay,
                 prev = now;
             }
         }
+        for (auto& th : workers) {
+            th.join();
+        }
+    } else if (stream) {
+        // 届いた分だけ読み取ってエンコードし、出力は指定した遅延以内に書き出す
+        auto& r = reader[0];
+        fflush(fp_out.get()); // wavヘッダはすぐに書き出す
+        FAWStreamOutput streamOut(fp_out, output, writeBytesTotal, latency);
+        auto write_stream = [&](const std::chrono::steady_clock::time_point arrival) {
+            streamOut.writeZero(r.out_buffer.zeroHead, arrival);
+            streamOut.write(r.out_buffer.data.data(), r.out_buffer.data.size(), arrival);
+            streamOut.writeZero(r.out_buffer.zeroTail, arrival);
+            r.out_buffer.clear();
+        };
+        auto prev = std::chrono::system_clock::now();
+        for (;;) {
+            const int64_t readBytes = stream_read(r.fpin, r.buffer.data(), r.buffer.size(), streamOut.timeout());
+            if (readBytes < 0) {
+                break;
+            }
+            if (readBytes > 0) {
+                r.drop.advance(r.readBytesTotal);
+                r.readBytesTotal += readBytes;
+                r.encoder.encode(r.out_buffer, r.buffer.data(), (size_t)readBytes);
+                write_stream(std::chrono::steady_clock::now());
+                dropOut.advance(writeBytesTotal);
 
-        // 最後まで処理
-        for (auto& r : reader) {
-            r.encoder.fin(r.out_buffer);
+                // 進捗表示
+                auto now = std::chrono::system_clock::now();
+                if (std::chrono::duration_cast<std::chrono::milliseconds>(now - prev).count() > 500) {
+                    write_size(_T("Writing"), writeBytesTotal, true);
+                    prev = now;
+                }
+            }
+            streamOut.update();
         }
-        // 最後まで出力するため、長いほうに合わせる
-        const auto process_data = std::max(reader[0].out_tmp.size(), reader[1].out_tmp.size());
-        for (auto& r : reader) {
-            r.out_tmp.resize(process_data, 0); // 短いほうは0で埋める
-        }
-        // FAW mixで出力
-        outfawmix.resize(process_data * sizeof(uint16_t));
-        uint16_t *const ptr_mix = (uint16_t *)outfawmix.data();
-        const uint8_t *out_tmp0 = reader[0].out_tmp.data();
-        const uint8_t *out_tmp1 = reader[1].out_tmp.data();
-        for (size_t i = 0; i < process_data; i++) {
-            const uint8_t v0 = out_tmp0[i] - 128;
-            const uint8_t v1 = out_tmp1[i] - 128;
-            ptr_mix[i] = ((((uint16_t)v0) << 8) | (uint16_t)v1);
-        }
-        write_buffer(fp_out, output, writeBytesTotal, outfawmix.data(), outfawmix.size());
+        // 最後まで処理
+        r.encoder.fin(r.out_buffer);
+        write_stream(std::chrono::steady_clock::now());
+        streamOut.flush();
+        streamOut.print();
+    } else if (threads > 1 && !reader[0].uring.isOpen()) {
+        // 読み取り・エンコード・書き込みを別々のスレッドで行い、入出力とエンコードを同時に進める
+        auto& r = reader[0];
+        auto prev = std::chrono::system_clock::now();
+        run_pipeline<RGYFAWEncoderOutput>(r.fpin, r.buffer.size(),
+            [&](RGYFAWEncoderOutput& out, const uint8_t *data, const size_t size) {
+                r.drop.advance(r.readBytesTotal);
+                r.readBytesTotal += size;
+                out.clear();
+                if (size == 0) {
+                    // 最後まで処理
+                    r.encoder.fin(out);
+                } else {
+                    r.encoder.encode(out, data, size);
+                }
+            },
+            [&](RGYFAWEncoderOutput& out) {
+                write_encoded(out);
+
+                // 進捗表示
+                auto now = std::chrono::system_clock::now();
+                if (std::chrono::duration_cast<std::chrono::milliseconds>(now - prev).count() > 500) {
+                    write_size(_T("Writing"), writeBytesTotal, true);
+                    prev = now;
+                }
+            });
     } else {
         auto& r = reader[0];
-        auto readBytes = _fread_nolock(r.buffer.data(), 1, r.buffer.size(), r.fpin);
-        r.encoder.encode(r.out_buffer, r.buffer.data(), readBytes);
-        write_buffer(fp_out, output, writeBytesTotal, r.out_buffer.data(), r.out_buffer.size());
+        const uint8_t *data = nullptr;
+        auto readBytes = r.read(data);
+        r.encoder.encode(r.out_buffer, data, readBytes);
+        write_encoded(r.out_buffer);
 
         auto prev = std::chrono::system_clock::now();
-        while ((readBytes = _fread_nolock(r.buffer.data(), 1, r.buffer.size(), r.fpin)) > 0) {
+        while ((readBytes = r.read(data)) > 0) {
             r.readBytesTotal += readBytes;
-            r.encoder.encode(r.out_buffer, r.buffer.data(), readBytes);
-            write_buffer(fp_out, output, writeBytesTotal, r.out_buffer.data(), r.out_buffer.size());
+            r.encoder.encode(r.out_buffer, data, readBytes);
+            write_encoded(r.out_buffer);
 
             // 進捗表示
             auto now = std::chrono::system_clock::now();
@@ -321,14 +2123,41 @@ static int run_encode(const RGYFAWMode fawmode, const std::array<int, 2>& delay,
         }
         // 最後まで処理
         r.encoder.fin(r.out_buffer);
-        write_buffer(fp_out, output, writeBytesTotal, r.out_buffer.data(), r.out_buffer.size());
+        write_encoded(r.out_buffer);
     }
 
-    // wavヘッダの上書き
+    // wavヘッダの上書き (シークできない場合は、先に書き込んだwavヘッダのままとする)
     wavheader.data_size = (decltype(wavheader.data_size))std::min<uint64_t>(writeBytesTotal - WAVE_HEADER_SIZE, std::numeric_limits<decltype(wavheader.data_size)>::max());
+    if (writeIndex && !is_pipe(output.c_str())) {
+        // 各音声のブロックの位置を、data chunkの先頭からの位置にする (FAW mixでは1byteが16bitになる)
+        std::vector<RGYFAWBlockIndex> index;
+        for (size_t ifile = 0; ifile < reader.size(); ifile++) {
+            for (auto entry : reader[ifile].encoder.index()) {
+                entry.offset = 4 + entry.offset * ((reader.size() > 1) ? sizeof(uint16_t) : 1);
+                entry.track = (uint32_t)ifile;
+                index.push_back(entry);
+            }
+        }
+        const auto trailer = create_index_trailer(index, writeBytesTotal - WAVE_HEADER_SIZE);
+        write_data(trailer.data(), trailer.size());
+        wavheader.extra_size = (uint32_t)trailer.size();
+    }
     std::vector<uint8_t> wavheaderBytes = wavheader.createHeader();
-    _fseeki64(fp_out.get(), 0, SEEK_SET);
-    fwrite(wavheaderBytes.data(), 1, wavheaderBytes.size(), fp_out.get());
+    if (use_uring_out) {
+        if (!uringOut.flush() || !uringOut.writeAt(wavheaderBytes.data(), wavheaderBytes.size(), 0)) {
+            _ftprintf(stderr, _T("failed to write output file: %s!\n"), output.c_str());
+            return 1;
+        }
+    } else if (_fseeki64(fp_out.get(), 0, SEEK_SET) == 0) {
+        fwrite(wavheaderBytes.data(), 1, wavheaderBytes.size(), fp_out.get());
+    }
+    if (fp_out) {
+        fflush(fp_out.get());
+    }
+    dropOut.finish();
+    for (auto& r : reader) {
+        r.drop.finish();
+    }
 
     _ftprintf(stderr, _T("\nFinished\n"));
     for (auto& r : reader) {
@@ -338,11 +2167,15 @@ static int run_encode(const RGYFAWMode fawmode, const std::array<int, 2>& delay,
     return 0;
 }
 
-static int run(const int mode, const RGYFAWMode fawmode, const std::array<int,2>& delay, const std::array<tstring, 2>& input, const std::array<tstring,2>& output) {
+static int run(const int mode, const RGYFAWMode fawmode, const int threads, int mmapMode, const bool writeIndex, const bool nocache, const int latency, const std::array<int,2>& delay, const std::array<tstring, 2>& input, const std::array<tstring,2>& output) {
+    if (mmapMode == MMAP_MODE_IO_URING && !FAWUring::available()) {
+        _ftprintf(stderr, _T("io_uring is not available, using read/write instead.\n"));
+        mmapMode = 0;
+    }
     if (mode == FAW_DEC) {
-        return run_decode(fawmode, input[0], output);
+        return run_decode(fawmode, threads, mmapMode, nocache, latency, input[0], output);
     } else {
-        return run_encode(fawmode, delay, input, output[0]);
+        return run_encode(fawmode, threads, mmapMode, writeIndex, nocache, latency, delay, input, output[0]);
     }
 }
 
@@ -385,6 +2218,11 @@ int _tmain(int argc, const TCHAR **argv) {
     int mode = FAW_ENC;
     RGYFAWMode fawmode = RGYFAWMode::Full;
     std::array<int, 2> delay = { 0, 0 };
+    int threads = 1;
+    int mmapMode = 1;
+    bool writeIndex = false;
+    bool nocache = false;
+    int latency = -1;
     for (int i = 0; i < argc; i++) {
         if (_tcscmp(_T("-h"), argv[i]) == 0) {
             print_help();
@@ -394,6 +2232,14 @@ int _tmain(int argc, const TCHAR **argv) {
             mode = FAW_DEC;
             iargoffset++;
         }
+        if (_tcscmp(_T("-i"), argv[i]) == 0) {
+            writeIndex = true;
+            iargoffset++;
+        }
+        if (_tcscmp(_T("-n"), argv[i]) == 0) {
+            nocache = true;
+            iargoffset++;
+        }
         if (_tcsncmp(_T("-d"), argv[i], 2) == 0) {
             try {
                 delay[0] = std::stoi(argv[i] + 2);
@@ -418,6 +2264,43 @@ int _tmain(int argc, const TCHAR **argv) {
             }
             iargoffset++;
         }
+        if (_tcsncmp(_T("-t"), argv[i], 2) == 0) {
+            try {
+                threads = std::stoi(argv[i] + 2);
+                if (threads <= 0) {
+                    threads = std::max<int>(1, std::thread::hardware_concurrency());
+                }
+            } catch (...) {
+                _ftprintf(stderr, _T("Invalid threads set.\n"));
+                return 1;
+            }
+            iargoffset++;
+        }
+        if (_tcsncmp(_T("-l"), argv[i], 2) == 0) {
+            try {
+                latency = std::stoi(argv[i] + 2);
+                if (latency < 0) {
+                    throw std::invalid_argument("latency");
+                }
+            } catch (...) {
+                _ftprintf(stderr, _T("Invalid latency set.\n"));
+                return 1;
+            }
+            iargoffset++;
+        }
+        if (_tcsncmp(_T("-m"), argv[i], 2) == 0) {
+            try {
+                mmapMode = std::stoi(argv[i] + 2);
+            } catch (...) {
+                _ftprintf(stderr, _T("Invalid mmap mode set.\n"));
+                return 1;
+            }
+            if (mmapMode < 0 || mmapMode > MMAP_MODE_IO_URING) {
+                _ftprintf(stderr, _T("Invalid mmap mode set.\n"));
+                return 1;
+            }
+            iargoffset++;
+        }
     }
 
     std::array<tstring, 2> input;
@@ -512,5 +2395,5 @@ int _tmain(int argc, const TCHAR **argv) {
     _ftprintf(stderr, _T("mode:   %s\n"), (mode == FAW_DEC) ? _T("wav -> aac") : _T("aac -> wav"));
     _ftprintf(stderr, _T("input:  %s%s%s\n"), str_input(input[0], delay[0]).c_str(), (input[1].length() > 0 ? _T("\n        ") :_T("")), str_input(input[1], delay[1]).c_str());
     _ftprintf(stderr, _T("output: %s\n"), is_pipe(output[0].c_str()) ? _T("stdout") : output[0].c_str());
-    return run(mode, fawmode, delay, input, output);
+    return run(mode, fawmode, threads, mmapMode, writeIndex, nocache, latency, delay, input, output);
 }
@@ -0,0 +1,17 @@
+#define ENABLE_RAW_READER 0
+#define ENABLE_AVI_READER 0
+#define ENABLE_AVISYNTH_READER 0
+#define ENABLE_VAPOURSYNTH_READER 0
+#define ENABLE_AVSW_READER 0
+#define ENABLE_SM_READER 0
+#define ENABLE_CUSTOM_VPP 0
+#define ENABLE_LIBASS_SUBBURN 0
+#define ENABLE_ADVANCED_DEINTERLACE 0
+#define ENABLE_MVC_ENCODING 0
+#define ENABLE_FPS_CONVERSION 0
+#define ENABLE_OPENCL 0
+#define ENABLE_SESSION_THREAD_CONFIG 0
+#define ENABLE_AVCODEC_OUT_THREAD 0
+#define AV_CHANNEL_LAYOUT_STRUCT_AVAIL 0
+#define ENABLE_CPP_REGEX 0
+#define ENABLE_DTL 0
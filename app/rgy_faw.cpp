@@ -27,6 +27,9 @@
 
 #include <vector>
 #include <array>
+#include <thread>
+#include <limits>
+#include <algorithm>
 #include "rgy_faw.h"
 #include "rgy_simd.h"
 
@@ -45,9 +48,32 @@ decltype(rgy_memmem_fawstart1_c)* get_memmem_fawstart1_func() {
     return rgy_memmem_fawstart1_c;
 }
 
-static const std::array<uint8_t, 2> AACSYNC_BYTES = { 0xff, 0xf0 };
+size_t rgy_memmem_faw_half_c(const void *data_, const size_t data_size, const void *target_, const size_t target_size, const bool upperhalf) {
+    const uint16_t *data = (const uint16_t *)data_;
+    const uint8_t *target = (const uint8_t *)target_;
+    if (data_size < target_size) {
+        return RGY_MEMMEM_NOT_FOUND;
+    }
+    for (size_t i = 0; i <= data_size - target_size; i++) {
+        if (faw_half_equal(data + i, target, target_size, upperhalf)) {
+            return i;
+        }
+    }
+    return RGY_MEMMEM_NOT_FOUND;
+}
+
+decltype(rgy_memmem_faw_half_c)* get_memmem_faw_half_func() {
+#if defined(_M_IX86) || defined(_M_X64) || defined(__x86_64)
+    const auto simd = get_availableSIMD();
+#if defined(_M_X64) || defined(__x86_64)
+    if ((simd & RGY_SIMD::AVX512BW) == RGY_SIMD::AVX512BW) return rgy_memmem_faw_half_avx512bw;
+#endif
+    if ((simd & RGY_SIMD::AVX2) == RGY_SIMD::AVX2) return rgy_memmem_faw_half_avx2;
+#endif
+    return rgy_memmem_faw_half_c;
+}
 
-static size_t rgy_find_aacsync_c(const void *data_, const size_t data_size) {
+size_t rgy_find_aacsync_c(const void *data_, const size_t data_size) {
     const uint16_t target = *(const uint16_t *)AACSYNC_BYTES.data();
     const size_t target_size = AACSYNC_BYTES.size();
     const uint8_t *data = (const uint8_t *)data_;
@@ -62,77 +88,105 @@ static size_t rgy_find_aacsync_c(const void *data_, const size_t data_size) {
     return RGY_MEMMEM_NOT_FOUND;
 }
 
-//16bit音声 -> 8bit音声
-void rgy_convert_audio_16to8(uint8_t *dst, const short *src, const size_t n) {
-    uint8_t *byte = dst;
-    const uint8_t *fin = byte + n;
-    const short *sh = src;
-    while (byte < fin) {
-        *byte = (*sh >> 8) + 128;
-        byte++;
-        sh++;
+decltype(rgy_find_aacsync_c)* get_find_aacsync_func() {
+#if defined(_M_IX86) || defined(_M_X64) || defined(__x86_64)
+    const auto simd = get_availableSIMD();
+#if defined(_M_X64) || defined(__x86_64)
+    if ((simd & RGY_SIMD::AVX512BW) == RGY_SIMD::AVX512BW) return rgy_find_aacsync_avx512bw;
+#endif
+    if ((simd & RGY_SIMD::AVX2) == RGY_SIMD::AVX2) return rgy_find_aacsync_avx2;
+#endif
+    return rgy_find_aacsync_c;
+}
+
+template<bool ishalf, bool upperhalf>
+void faw_read(uint8_t *dst, const uint8_t *src, const size_t outlen) {
+    if (!ishalf) {
+        memcpy(dst, src, outlen);
+        return;
+    }
+    const uint16_t *srcPtr = (const uint16_t *)src;
+    for (size_t i = 0; i < outlen; i++) {
+        dst[i] = faw_read_half<upperhalf>(srcPtr[i]);
+    }
+}
+
+template<bool ishalf, bool upperhalf>
+static bool faw_equal(const uint8_t *src, const uint8_t *target, const size_t length) {
+    if (!ishalf) {
+        return memcmp(src, target, length) == 0;
     }
+    return faw_half_equal((const uint16_t *)src, target, length, upperhalf);
+}
+
+uint32_t rgy_faw_checksum_c(const uint8_t *data, const size_t data_size) {
+    return faw_checksum_tail(0, 0, data, 0, data_size);
+}
+
+uint32_t rgy_faw_copy_checksum_c(uint8_t *dst, const uint8_t *src, const size_t size) {
+    memcpy(dst, src, size);
+    return faw_checksum_tail(0, 0, src, 0, size);
 }
 
-void rgy_split_audio_16to8x2(uint8_t *dst0, uint8_t *dst1, const short *src, const size_t n) {
-    const short *sh = src;
-    const short *sh_fin = src + n;
-    for (; sh < sh_fin; sh++, dst0++, dst1++) {
-        *dst0 = (*sh >> 8) + 128;
-        *dst1 = (*sh & 0xff) + 128;
+uint32_t rgy_faw_read_half_checksum_c(uint8_t *dst, const void *src_, const size_t size, const bool upperhalf) {
+    if (upperhalf) {
+        faw_read<true, true>(dst, (const uint8_t *)src_, size);
+    } else {
+        faw_read<true, false>(dst, (const uint8_t *)src_, size);
     }
+    return faw_checksum_tail(0, 0, dst, 0, size);
 }
 
-decltype(rgy_convert_audio_16to8)* get_convert_audio_16to8_func() {
+decltype(rgy_faw_checksum_c)* get_faw_checksum_func() {
 #if defined(_M_IX86) || defined(_M_X64) || defined(__x86_64)
     const auto simd = get_availableSIMD();
-    if ((simd & RGY_SIMD::AVX2) == RGY_SIMD::AVX2) return rgy_convert_audio_16to8_avx2;
+#if defined(_M_X64) || defined(__x86_64)
+    if ((simd & RGY_SIMD::AVX512BW) == RGY_SIMD::AVX512BW) return rgy_faw_checksum_avx512bw;
+#endif
+    if ((simd & RGY_SIMD::AVX2) == RGY_SIMD::AVX2) return rgy_faw_checksum_avx2;
 #endif
-    return rgy_convert_audio_16to8;
+    return rgy_faw_checksum_c;
 }
 
-decltype(rgy_split_audio_16to8x2)* get_split_audio_16to8x2_func() {
+decltype(rgy_faw_copy_checksum_c)* get_faw_copy_checksum_func() {
 #if defined(_M_IX86) || defined(_M_X64) || defined(__x86_64)
     const auto simd = get_availableSIMD();
-    if ((simd & RGY_SIMD::AVX2) == RGY_SIMD::AVX2) return rgy_split_audio_16to8x2_avx2;
+#if defined(_M_X64) || defined(__x86_64)
+    if ((simd & RGY_SIMD::AVX512BW) == RGY_SIMD::AVX512BW) return rgy_faw_copy_checksum_avx512bw;
+#endif
+    if ((simd & RGY_SIMD::AVX2) == RGY_SIMD::AVX2) return rgy_faw_copy_checksum_avx2;
 #endif
-    return rgy_split_audio_16to8x2;
+    return rgy_faw_copy_checksum_c;
 }
 
-template<bool upperhalf>
-static uint8_t faw_read_half(const uint16_t v) {
-    uint8_t i = (upperhalf) ? (v & 0xff00) >> 8 : (v & 0xff);
-    return i - 0x80;
+decltype(rgy_faw_read_half_checksum_c)* get_faw_read_half_checksum_func() {
+#if defined(_M_IX86) || defined(_M_X64) || defined(__x86_64)
+    const auto simd = get_availableSIMD();
+#if defined(_M_X64) || defined(__x86_64)
+    if ((simd & RGY_SIMD::AVX512BW) == RGY_SIMD::AVX512BW) return rgy_faw_read_half_checksum_avx512bw;
+#endif
+    if ((simd & RGY_SIMD::AVX2) == RGY_SIMD::AVX2) return rgy_faw_read_half_checksum_avx2;
+#endif
+    return rgy_faw_read_half_checksum_c;
 }
 
-template<bool ishalf, bool upperhalf>
-void faw_read(uint8_t *dst, const uint8_t *src, const size_t outlen) {
-    if (!ishalf) {
-        memcpy(dst, src, outlen);
-        return;
-    }
-    const uint16_t *srcPtr = (const uint16_t *)src;
-    for (size_t i = 0; i < outlen; i++) {
-        dst[i] = faw_read_half<upperhalf>(srcPtr[i]);
+void rgy_merge_audio_8x2to16_c(uint16_t *dst, const uint8_t *src0, const uint8_t *src1, const size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        const uint8_t v0 = src0[i] - 128;
+        const uint8_t v1 = src1[i] - 128;
+        dst[i] = ((((uint16_t)v0) << 8) | (uint16_t)v1);
     }
 }
 
-static uint32_t faw_checksum_calc(const uint8_t *buf, const size_t len) {
-    uint32_t _v4288 = 0;
-    uint32_t _v48 = 0;
-    const size_t fin_mod2 = (len & (~1));
-    for (size_t i = 0; i < fin_mod2; i += 2) {
-        uint32_t _v132 = *(uint16_t *)(buf + i);
-        _v4288 += _v132;
-        _v48 ^= _v132;
-    }
-    if ((len & 1) != 0) {
-        uint32_t _v132 = *(uint8_t *)(buf + len - 1);
-        _v4288 += _v132;
-        _v48 ^= _v132;
-    }
-    uint32_t res = (_v4288 & 0xffff) | ((_v48 & 0xffff) << 16);
-    return res;
+decltype(rgy_merge_audio_8x2to16_c)* get_merge_audio_8x2to16_func() {
+#if defined(_M_IX86) || defined(_M_X64) || defined(__x86_64)
+    const auto simd = get_availableSIMD();
+#if defined(_M_X64) || defined(__x86_64)
+    if ((simd & RGY_SIMD::AVX512BW) == RGY_SIMD::AVX512BW) return rgy_merge_audio_8x2to16_avx512bw;
+#endif
+    if ((simd & RGY_SIMD::AVX2) == RGY_SIMD::AVX2) return rgy_merge_audio_8x2to16_avx2;
+#endif
+    return rgy_merge_audio_8x2to16_c;
 }
 
 static uint32_t faw_checksum_read(const uint8_t *buf) {
@@ -185,12 +239,17 @@ void RGYAACHeader::parse(const uint8_t *buf) {
 
 RGYFAWBitstream::RGYFAWBitstream() :
     buffer(),
-    bufferLength(0),
+    bufferExt(nullptr),
     bufferOffset(0),
+    bufferLength(0),
+    scannedLength(0),
     bytePerWholeSample(0),
+    inputElemSize(1),
     inputLengthByte(0),
     outSamples(0),
-    aacHeader() {
+    nextBlockPos(-1),
+    aacHeader(),
+    blockData() {
 
 }
 
@@ -200,6 +259,17 @@ void RGYFAWBitstream::setBytePerSample(const int val) {
     bytePerWholeSample = val;
 }
 
+void RGYFAWBitstream::setElemSize(const int val) {
+    inputElemSize = val;
+}
+
+uint8_t *RGYFAWBitstream::blockBuffer(const size_t size) {
+    if (blockData.size() < size) {
+        blockData.resize(size);
+    }
+    return blockData.data();
+}
+
 void RGYFAWBitstream::parseAACHeader(const uint8_t *buf) {
     aacHeader.parse(buf);
 }
@@ -222,6 +292,18 @@ void RGYFAWBitstream::addOffset(size_t offset) {
     } else {
         bufferOffset += offset;
     }
+    scannedLength = (scannedLength > offset) ? scannedLength - offset : 0;
+}
+
+// サンプル位置の計算がずれないよう、サンプル単位に切り捨てた長さだけ破棄する
+// 戻り値は実際に破棄したbyte数
+size_t RGYFAWBitstream::discard(size_t length) {
+    const size_t sampleSize = std::max(bytePerWholeSample, 1);
+    const size_t offset = std::min(length, bufferLength) / sampleSize * sampleSize;
+    if (offset > 0) {
+        addOffset(offset);
+    }
+    return offset;
 }
 
 void RGYFAWBitstream::addOutputSamples(size_t samples) {
@@ -229,37 +311,83 @@ void RGYFAWBitstream::addOutputSamples(size_t samples) {
 }
 
 
+// inputLengthはdata()上のbyte数 (inputからはinputLength * elemSize() byteをコピーする)
 void RGYFAWBitstream::append(const uint8_t *input, const size_t inputLength) {
-    if (buffer.size() < bufferLength + inputLength) {
-        buffer.resize(std::max(bufferLength + inputLength, buffer.size() * 2));
+    const size_t elem = inputElemSize;
+    if (buffer.size() < (bufferLength + inputLength) * elem) {
+        buffer.resize(std::max((bufferLength + inputLength) * elem, buffer.size() * 2));
         if (bufferLength == 0) {
             bufferOffset = 0;
         }
         if (bufferOffset > 0) {
-            memmove(buffer.data(), buffer.data() + bufferOffset, bufferLength);
+            memmove(buffer.data(), buffer.data() + bufferOffset * elem, bufferLength * elem);
             bufferOffset = 0;
         }
-    } else if (buffer.size() < bufferOffset + bufferLength + inputLength) {
+    } else if (buffer.size() < (bufferOffset + bufferLength + inputLength) * elem) {
         if (bufferLength == 0) {
             bufferOffset = 0;
         }
         if (bufferOffset > 0) {
-            memmove(buffer.data(), buffer.data() + bufferOffset, bufferLength);
+            memmove(buffer.data(), buffer.data() + bufferOffset * elem, bufferLength * elem);
             bufferOffset = 0;
         }
     }
     if (input != nullptr) {
-        memcpy(buffer.data() + bufferOffset + bufferLength, input, inputLength);
+        memcpy(buffer.data() + (bufferOffset + bufferLength) * elem, input, inputLength * elem);
     }
     bufferLength += inputLength;
     inputLengthByte += inputLength;
 }
 
+// inputを追加するが、末尾のkeepLength分以外は保持せずに読み捨てる
+// 破棄はdiscard()と同様にサンプル単位で行う
+void RGYFAWBitstream::appendTail(const uint8_t *input, const size_t inputLength, const size_t keepLength) {
+    const size_t sampleSize = std::max(bytePerWholeSample, 1);
+    const size_t totalLength = bufferLength + inputLength;
+    const size_t discardLength = (totalLength - std::min(totalLength, keepLength)) / sampleSize * sampleSize;
+    if (discardLength <= bufferLength) {
+        append(input, inputLength);
+        addOffset(discardLength);
+        return;
+    }
+    const size_t inputDiscardLength = discardLength - bufferLength;
+    addOffset(bufferLength);
+    inputLengthByte += inputDiscardLength;
+    append(input + inputDiscardLength * inputElemSize, inputLength - inputDiscardLength);
+}
+
+// 未処理のデータ(size()分)がinputの先頭と同じ内容であるとして、
+// 以降はbufferにコピーせずinputを直接参照する
+// inputはdetach()までの間、有効である必要がある
+void RGYFAWBitstream::attach(const uint8_t *input, const size_t inputLength) {
+    inputLengthByte += inputLength - bufferLength;
+    bufferExt = (uint8_t *)input;
+    bufferOffset = 0;
+    bufferLength = inputLength;
+}
+
+// 参照していたinputのうち、未処理の部分のみをbufferにコピーする
+void RGYFAWBitstream::detach() {
+    if (bufferExt == nullptr) {
+        return;
+    }
+    const uint8_t *remain = bufferExt + bufferOffset * inputElemSize;
+    const size_t remainLength = bufferLength;
+    bufferExt = nullptr;
+    bufferOffset = 0;
+    bufferLength = 0;
+    inputLengthByte -= remainLength;
+    append(remain, remainLength);
+}
+
 void RGYFAWBitstream::clear() {
+    bufferExt = nullptr;
     bufferLength = 0;
     bufferOffset = 0;
+    scannedLength = 0;
     inputLengthByte = 0;
     outSamples = 0;
+    nextBlockPos = -1;
 }
 
 static const std::array<uint8_t, 16> aac_silent0 = {
@@ -282,27 +410,45 @@ static const std::array<uint8_t, 33> aac_silent6 = {
     0xE0
 };
 
+// 並列デコードを行う場合の、1スレッドあたりの最小のデータ量
+static const size_t DECODE_PARALLEL_MIN_SIZE = 1024 * 1024;
+// FAW half size mixの判別時に、片方の音声でのみ見つかったfawstart1以降を残すブロック数の上限
+static const size_t MIX_DETECT_MAX_BLOCKS = 4;
+
 RGYFAWDecoder::RGYFAWDecoder() :
     wavheader(),
     fawmode(RGYFAWMode::Unknown),
+    threads(1),
+    dataRemain(std::numeric_limits<uint64_t>::max()),
+    partialSample(),
     bufferIn(),
     bufferHalf0(),
     bufferHalf1(),
     funcMemMem(get_memmem_func()),
     funcMemMemFAWStart1(get_memmem_fawstart1_func()),
-    funcAudio16to8(get_convert_audio_16to8_func()),
-    funcSplitAudio16to8x2(get_split_audio_16to8x2_func()) {
+    funcMemMemHalf(get_memmem_faw_half_func()),
+    funcChecksum(get_faw_checksum_func()),
+    funcReadHalfChecksum(get_faw_read_half_checksum_func()) {
 }
 RGYFAWDecoder::~RGYFAWDecoder() {
 
 }
 
 void RGYFAWDecoder::setWavInfo() {
+    partialSample.clear();
     bufferIn.setBytePerSample(wavheader.number_of_channels * wavheader.bits_per_sample / 8);
+    bufferHalf0.setElemSize(sizeof(short));
+    bufferHalf1.setElemSize(sizeof(short));
     if (wavheader.bits_per_sample > 8) {
         bufferHalf0.setBytePerSample(wavheader.number_of_channels * wavheader.bits_per_sample / 16);
         bufferHalf1.setBytePerSample(wavheader.number_of_channels * wavheader.bits_per_sample / 16);
     }
+    // RIFFの長さからdata chunkの後ろに別のchunk(ブロックの位置など)があるとわかる場合は、data chunkの長さまでを処理する
+    // それ以外の場合は、data chunkの長さが正しくないことがあるので、入力をすべて処理する
+    dataRemain = std::numeric_limits<uint64_t>::max();
+    if (wavheader.data_size > 0 && (uint64_t)wavheader.file_size > (uint64_t)wavheader.data_size + WAVE_HEADER_SIZE - 8) {
+        dataRemain = wavheader.data_size;
+    }
 }
 
 int RGYFAWDecoder::init(const uint8_t *data) {
@@ -317,80 +463,196 @@ int RGYFAWDecoder::init(const RGYWAVHeader *data) {
     return 0;
 }
 
-void RGYFAWDecoder::appendFAWHalf(const uint8_t *data, const size_t dataLength) {
-    const auto prevSize = bufferHalf0.size();
-    bufferHalf0.append(nullptr, dataLength / sizeof(short));
-    funcAudio16to8(bufferHalf0.data() + prevSize, (const short *)data, dataLength / sizeof(short));
-}
-
-void RGYFAWDecoder::appendFAWMix(const uint8_t *data, const size_t dataLength) {
-    const auto prevSize0 = bufferHalf0.size();
-    const auto prevSize1 = bufferHalf1.size();
-    bufferHalf0.append(nullptr, dataLength / sizeof(short));
-    bufferHalf1.append(nullptr, dataLength / sizeof(short));
-    funcSplitAudio16to8x2(bufferHalf0.data() + prevSize0, bufferHalf1.data() + prevSize1, (const short *)data, dataLength / sizeof(short));
+// 破棄したブロック以外をtrackごとのvectorに追加する
+static RGYFAWFrameSink faw_vector_sink(RGYFAWDecoderOutput& output) {
+    return [&output](const int track, const RGYFAWFrame& frame) {
+        if ((frame.flags & RGYFAWFrameFlags::DROPPED) == RGYFAWFrameFlags::DROPPED) {
+            return;
+        }
+        auto& out = output[track];
+        const auto orig_size = out.size();
+        out.resize(orig_size + frame.size);
+        memcpy(out.data() + orig_size, frame.ptr, frame.size);
+    };
 }
 
 int RGYFAWDecoder::decode(RGYFAWDecoderOutput& output, const uint8_t *input, const size_t inputLength) {
     for (auto& b : output) {
         b.clear();
     }
+    return decode(faw_vector_sink(output), input, inputLength);
+}
 
-    bool inputDataAppended = false;
+int RGYFAWDecoder::decode(const RGYFAWFrameSink& sink, const uint8_t *input, const size_t inputLength) {
+    size_t length = (size_t)std::min<uint64_t>(inputLength, dataRemain);
+    dataRemain -= length;
+    // パイプなどからの入力はサンプルの途中で切れていることがあるので、
+    // 1サンプルに満たない末尾は次回の入力の先頭に連結して、常にサンプル単位で処理する
+    const size_t sampleSize = (size_t)std::max(wavheader.number_of_channels * wavheader.bits_per_sample / 8, 1);
+    if (sampleSize <= 1) {
+        return decodeData(sink, input, length);
+    }
+    int ret = 0;
+    if (partialSample.size() > 0) {
+        const size_t appendLength = std::min(length, sampleSize - partialSample.size());
+        partialSample.insert(partialSample.end(), input, input + appendLength);
+        input += appendLength;
+        length -= appendLength;
+        if (partialSample.size() < sampleSize) {
+            return (fawmode == RGYFAWMode::Unknown) ? -1 : 0;
+        }
+        ret = decodeData(sink, partialSample.data(), partialSample.size());
+        partialSample.clear();
+    }
+    const size_t partialLength = length % sampleSize;
+    if (length > partialLength) {
+        ret = decodeData(sink, input, length - partialLength);
+    }
+    partialSample.assign(input + length - partialLength, input + length);
+    return ret;
+}
 
+int RGYFAWDecoder::decodeData(const RGYFAWFrameSink& sink, const uint8_t *input, const size_t inputLength) {
     // FAWの種類を判別
     if (fawmode == RGYFAWMode::Unknown) {
-        bufferIn.append(input, inputLength);
-        inputDataAppended = true;
-
-        int64_t ret0 = 0, ret1 = 0;
-        if ((ret0 = funcMemMemFAWStart1(bufferIn.data(), bufferIn.size())) != RGY_MEMMEM_NOT_FOUND) {
+        // 判別できなかった部分は末尾以外破棄しているので、前回までの入力は再探索しない
+        // bufferInには前回の入力の末尾のみが残っているので、つなぎ目は先頭部分のみ連結して確認する
+        std::array<uint8_t, fawstart2.size() * 2> boundary;
+        const size_t boundaryTail = std::min(bufferIn.size(), fawstart2.size() - 1);
+        const size_t boundaryHead = std::min(inputLength, fawstart2.size() - 1);
+        memcpy(boundary.data(), bufferIn.data() + bufferIn.size() - boundaryTail, boundaryTail);
+        memcpy(boundary.data() + boundaryTail, input, boundaryHead);
+        auto findPattern = [&](const uint8_t *target, const size_t targetSize) {
+            return funcMemMem(boundary.data(), boundaryTail + boundaryHead, target, targetSize) != RGY_MEMMEM_NOT_FOUND
+                || funcMemMem(input, inputLength, target, targetSize) != RGY_MEMMEM_NOT_FOUND;
+        };
+        if (findPattern(fawstart1.data(), fawstart1.size())) {
             fawmode = RGYFAWMode::Full;
-        } else if ((ret0 = funcMemMem(bufferIn.data(), bufferIn.size(), fawstart2.data(), fawstart2.size())) != RGY_MEMMEM_NOT_FOUND) {
+            bufferHalf0.clear();
+            bufferHalf1.clear();
+        } else if (findPattern(fawstart2.data(), fawstart2.size())) {
+            // bufferHalf0には、前回までの入力のうち必要な部分が残っている
             fawmode = RGYFAWMode::Half;
-            appendFAWHalf(bufferIn.data(), bufferIn.size());
             bufferIn.clear();
+            bufferHalf1.clear();
         } else {
-            appendFAWMix(bufferIn.data(), bufferIn.size());
-            if (   (ret0 = funcMemMemFAWStart1(bufferHalf0.data(), bufferHalf0.size())) != RGY_MEMMEM_NOT_FOUND
-                && (ret1 = funcMemMemFAWStart1(bufferHalf1.data(), bufferHalf1.size())) != RGY_MEMMEM_NOT_FOUND) {
+            // FAW half size mixの2つの音声は、16bitの上位/下位8bitにそれぞれ入っている
+            // bufferHalf0/1の後ろにinputを連結したものとして、inputはコピーせずに探索する
+            const size_t inputSamples = inputLength / sizeof(short);
+            auto findHalf = [&](const RGYFAWBitstream& bitstream, const bool upperhalf) {
+                auto ret = funcMemMemHalf(bitstream.data(), bitstream.size(), fawstart1.data(), fawstart1.size(), upperhalf);
+                if (ret != RGY_MEMMEM_NOT_FOUND) {
+                    return ret;
+                }
+                const size_t tailLength = std::min(bitstream.size(), fawstart1.size() - 1);
+                const size_t headLength = std::min(inputSamples, fawstart1.size() - 1);
+                std::array<uint8_t, fawstart1.size() * 2 * sizeof(short)> halfBoundary;
+                memcpy(halfBoundary.data(), bitstream.data() + (bitstream.size() - tailLength) * sizeof(short), tailLength * sizeof(short));
+                memcpy(halfBoundary.data() + tailLength * sizeof(short), input, headLength * sizeof(short));
+                ret = funcMemMemHalf(halfBoundary.data(), tailLength + headLength, fawstart1.data(), fawstart1.size(), upperhalf);
+                if (ret != RGY_MEMMEM_NOT_FOUND) {
+                    return bitstream.size() - tailLength + ret;
+                }
+                ret = funcMemMemHalf(input, inputSamples, fawstart1.data(), fawstart1.size(), upperhalf);
+                return (ret != RGY_MEMMEM_NOT_FOUND) ? bitstream.size() + ret : RGY_MEMMEM_NOT_FOUND;
+            };
+            const auto ret0 = findHalf(bufferHalf0, true);
+            const auto ret1 = findHalf(bufferHalf1, false);
+            if (ret0 != RGY_MEMMEM_NOT_FOUND && ret1 != RGY_MEMMEM_NOT_FOUND) {
                 fawmode = RGYFAWMode::Mix;
                 bufferIn.clear();
             } else {
-                bufferHalf0.clear();
-                bufferHalf1.clear();
+                // パターンの途中で切れている可能性のある末尾と、見つかったfawstart1以降のみ残す
+                bufferIn.appendTail(input, inputLength, fawstart2.size() - 1);
+                auto appendHalf = [&](RGYFAWBitstream& bitstream, const size_t ret, const bool upperhalf) {
+                    if (ret == RGY_MEMMEM_NOT_FOUND) {
+                        bitstream.appendTail(input, inputSamples, fawstart1.size() - 1);
+                        return;
+                    }
+                    bitstream.appendTail(input, inputSamples, bitstream.size() + inputSamples - ret);
+                    // 有効なブロックがあれば、もう片方の音声が遅れて始まるのを待つ間もそれ以降をすべて残す
+                    // 有効なブロックがないまま続く場合は、数ブロック分を超えた古い部分は破棄する
+                    const size_t posValid = (upperhalf) ? findValidBlock<true, true>(bitstream) : findValidBlock<true, false>(bitstream);
+                    const size_t keepMax = MIX_DETECT_MAX_BLOCKS * (FAW_BLOCK_MAX_SIZE + AAC_BLOCK_SAMPLES * bitstream.bytePerSample());
+                    bitstream.discard((posValid != RGY_MEMMEM_NOT_FOUND) ? posValid : bitstream.size() - std::min(bitstream.size(), keepMax));
+                };
+                appendHalf(bufferHalf0, ret0, true);
+                appendHalf(bufferHalf1, ret1, false);
             }
         }
     }
     if (fawmode == RGYFAWMode::Unknown) {
         return -1;
     }
-    if (!inputDataAppended) {
-        if (fawmode == RGYFAWMode::Full) {
-            bufferIn.append(input, inputLength);
-        } else if (fawmode == RGYFAWMode::Half) {
-            appendFAWHalf(input, inputLength);
-        } else if (fawmode == RGYFAWMode::Mix) {
-            appendFAWMix(input, inputLength);
-        }
-        inputDataAppended = true;
-    }
 
     // デコード
     if (fawmode == RGYFAWMode::Full) {
-        decode(output[0], bufferIn);
-    } else if (fawmode == RGYFAWMode::Half) {
-        decode(output[0], bufferHalf0);
+        return decodeDirect(sink, 0, bufferIn, input, inputLength);
+    }
+    // FAW half/mixも16bitの入力を直接探索するので、1byteあたり入力の2byteとなる
+    auto decodeHalf = [&](const int track, RGYFAWBitstream& bitstream) {
+        decodeDirect(sink, track, bitstream, input, inputLength / sizeof(short));
+    };
+    if (fawmode == RGYFAWMode::Half) {
+        decodeHalf(0, bufferHalf0);
     } else if (fawmode == RGYFAWMode::Mix) {
-        decode(output[0], bufferHalf0);
-        decode(output[1], bufferHalf1);
+        if (threads > 1 && inputLength / sizeof(short) >= DECODE_PARALLEL_MIN_SIZE) {
+            // 2つの音声は独立しているので、それぞれ別のスレッドでデコードする
+            // 入力が小さい場合は、スレッドを起動するコストのほうが大きいので分けない
+            std::thread decodeHalf1([&]() { decodeHalf(1, bufferHalf1); });
+            decodeHalf(0, bufferHalf0);
+            decodeHalf1.join();
+        } else {
+            decodeHalf(0, bufferHalf0);
+            decodeHalf(1, bufferHalf1);
+        }
+    }
+    return 0;
+}
+
+// inputをbitstreamにコピーせずに直接処理し、処理しきれなかった末尾のみbitstreamに残す
+// inputLengthはbitstream上のbyte数 (FAW half/mixでは入力のbyte数の半分)
+int RGYFAWDecoder::decodeDirect(const RGYFAWFrameSink& sink, const int track, RGYFAWBitstream& bitstream, const uint8_t *input, const size_t inputLength) {
+    size_t inputOffset = 0;
+    if (bitstream.size() > 0) {
+        // 前回の残りは、次のブロックが確定する分だけ追加して先に処理する
+        const size_t appendLength = std::min(inputLength, FAW_BLOCK_MAX_SIZE + AAC_BLOCK_SAMPLES * bitstream.bytePerSample());
+        bitstream.append(input, appendLength);
+        decode(sink, track, bitstream);
+        if (appendLength == inputLength) {
+            return 0;
+        }
+        if (bitstream.size() > appendLength) {
+            // 前回の残りがまだ必要なので、すべてコピーして処理する
+            bitstream.append(input + appendLength * bitstream.elemSize(), inputLength - appendLength);
+            return decode(sink, track, bitstream);
+        }
+        // 残っているのはinputに含まれる部分のみ
+        inputOffset = appendLength - bitstream.size();
     }
+    bitstream.attach(input + inputOffset * bitstream.elemSize(), inputLength - inputOffset);
+    decode(sink, track, bitstream);
+    bitstream.detach();
     return 0;
 }
 
-int RGYFAWDecoder::decode(std::vector<uint8_t>& output, RGYFAWBitstream& input) {
+int RGYFAWDecoder::decode(const RGYFAWFrameSink& sink, const int track, RGYFAWBitstream& input) {
+    if (fawmode == RGYFAWMode::Full) {
+        return decodeTrack<false, false>(sink, track, input);
+    }
+    // FAW halfとFAW half size mixの1つめの音声は上位8bit、2つめの音声は下位8bitに入っている
+    return (track == 0) ? decodeTrack<true, true>(sink, track, input) : decodeTrack<true, false>(sink, track, input);
+}
+
+template<bool ishalf, bool upperhalf>
+int RGYFAWDecoder::decodeTrack(const RGYFAWFrameSink& sink, const int track, RGYFAWBitstream& input) {
+    // FAW half size mixの場合は、2つの音声でスレッドを分け合う
+    const int trackThreads = (fawmode == RGYFAWMode::Mix) ? std::max(threads / 2, 1) : threads;
+    if (trackThreads > 1 && input.bytePerSample() > 0 && input.size() >= DECODE_PARALLEL_MIN_SIZE * trackThreads) {
+        return decodeParallel<ishalf, upperhalf>(sink, track, input, trackThreads);
+    }
     while (input.size() > 0) {
-        auto ret = decodeBlock(output, input);
+        auto ret = decodeBlock<ishalf, upperhalf>(sink, track, input);
         if (ret == 0) {
             break;
         }
@@ -398,71 +660,309 @@ int RGYFAWDecoder::decode(std::vector<uint8_t>& output, RGYFAWBitstream& input)
     return 0;
 }
 
-int RGYFAWDecoder::decodeBlock(std::vector<uint8_t>& output, RGYFAWBitstream& input) {
-    auto posStart = funcMemMemFAWStart1(input.data(), input.size());
-    if (posStart == RGY_MEMMEM_NOT_FOUND) {
-        return 0;
+// 入力を範囲ごとに分割して各スレッドでブロックを探索し、その結果を順につないで出力する
+template<bool ishalf, bool upperhalf>
+int RGYFAWDecoder::decodeParallel(const RGYFAWFrameSink& sink, const int track, RGYFAWBitstream& input, const int threads) {
+    const uint64_t inputStart = input.inputOffset();
+    const int bytePerSample = input.bytePerSample();
+    const size_t rangeLength = ((input.size() + threads - 1) / threads + bytePerSample - 1) / bytePerSample * bytePerSample;
+    // 範囲の終端をまたぐブロックも探索できるよう、最大ブロック長+ブロック間隔分は範囲外も参照する
+    const size_t rangeOverlap = FAW_BLOCK_MAX_SIZE + AAC_BLOCK_SAMPLES * bytePerSample;
+
+    std::vector<std::vector<RGYFAWBlockPos>> rangeBlocks(threads);
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++) {
+        workers.emplace_back([&, i]() {
+            const size_t rangeStart = std::min(input.size(), rangeLength * i);
+            const size_t rangeFin = std::min(input.size(), rangeStart + rangeLength);
+            RGYFAWBitstream bitstream;
+            bitstream.setBytePerSample(bytePerSample);
+            bitstream.setElemSize(input.elemSize());
+            bitstream.setInputOffset(inputStart + rangeStart);
+            bitstream.attach(input.data() + rangeStart * input.elemSize(), std::min(input.size(), rangeFin + rangeOverlap) - rangeStart);
+            // 範囲内から始まるブロックのみ探索する
+            RGYFAWBlock block;
+            while (findBlock<ishalf, upperhalf>(block, bitstream, inputStart + rangeFin)) {
+                rangeBlocks[i].push_back({ bitstream.inputOffset() + block.posStart, bitstream.inputOffset() + block.posFin, block.valid });
+                skipBlock(bitstream, block);
+            }
+        });
+    }
+    for (auto& th : workers) {
+        th.join();
     }
-    input.parseAACHeader(input.data() + posStart + fawstart1.size());
 
-    auto posFin = funcMemMem(input.data() + posStart + fawstart1.size(), input.size() - posStart - fawstart1.size(), fawfin1.data(), fawfin1.size());
-    if (posFin == RGY_MEMMEM_NOT_FOUND) {
+    // 各範囲の探索は同期していない状態から始めているので、そのままでは逐次処理の結果と異なる可能性がある
+    // 逐次処理で見つけた有効なブロックが範囲の探索結果にもあれば、以降はその範囲の探索結果と一致する
+    size_t irange = 0;
+    RGYFAWBlock block;
+    while (findBlock<ishalf, upperhalf>(block, input, std::numeric_limits<uint64_t>::max())) {
+        const uint64_t posStart = input.inputOffset() + block.posStart;
+        const uint64_t posFin = input.inputOffset() + block.posFin;
+        const bool valid = block.valid;
+        outputBlock<ishalf, upperhalf>(sink, track, input, block);
+        if (!valid) {
+            continue;
+        }
+        while (irange < rangeBlocks.size() && posStart >= inputStart + rangeLength * (irange + 1)) {
+            irange++;
+        }
+        if (irange >= rangeBlocks.size()) {
+            continue;
+        }
+        const auto& blocks = rangeBlocks[irange];
+        auto it = std::lower_bound(blocks.begin(), blocks.end(), posStart, [](const RGYFAWBlockPos& pos, const uint64_t start) { return pos.start < start; });
+        if (it == blocks.end() || it->start != posStart || it->fin != posFin || !it->valid) {
+            continue;
+        }
+        // 以降のブロックは探索済みの位置から出力する
+        for (it++; it != blocks.end(); it++) {
+            block.posStart = (size_t)(it->start - input.inputOffset());
+            block.posStart -= input.discard(block.posStart);
+            block.posFin = (size_t)(it->fin - input.inputOffset());
+            block.valid = it->valid;
+            parseHeader<ishalf, upperhalf>(input, block.posStart + fawstart1.size());
+            outputBlock<ishalf, upperhalf>(sink, track, input, block);
+        }
+        irange++;
+    }
+    return 0;
+}
+
+template<bool ishalf, bool upperhalf>
+int RGYFAWDecoder::decodeBlock(const RGYFAWFrameSink& sink, const int track, RGYFAWBitstream& input) {
+    RGYFAWBlock block;
+    if (!findBlock<ishalf, upperhalf>(block, input, std::numeric_limits<uint64_t>::max())) {
         return 0;
     }
-    posFin += posStart + fawstart1.size(); // データの先頭からの位置に変更
+    outputBlock<ishalf, upperhalf>(sink, track, input, block);
+    return 1;
+}
+
+// 次のブロックを探索し、checksumを確認する
+// posLimit(入力の先頭からのbyte数)以降から始まるブロックは探索しない
+// データが足りない場合はfalseを返す
+template<bool ishalf, bool upperhalf>
+bool RGYFAWDecoder::findBlock(RGYFAWBlock& block, RGYFAWBitstream& input, const uint64_t posLimit) const {
+    // FAW half/mixでは、16bitの入力の上位/下位8bitのみを参照する
+    auto ptr = [&input](const size_t pos) { return input.data() + pos * (ishalf ? 2 : 1); };
+    auto findFAWStart1 = [&](const size_t pos, const size_t size) {
+        return (ishalf) ? funcMemMemHalf(ptr(pos), size, fawstart1.data(), fawstart1.size(), upperhalf) : funcMemMemFAWStart1(ptr(pos), size);
+    };
+    auto findFAWFin1 = [&](const size_t pos, const size_t size) {
+        return (ishalf) ? funcMemMemHalf(ptr(pos), size, fawfin1.data(), fawfin1.size(), upperhalf) : funcMemMem(ptr(pos), size, fawfin1.data(), fawfin1.size());
+    };
+    size_t posStart = RGY_MEMMEM_NOT_FOUND;
+    if (input.nextBlock() >= 0) {
+        // 同期済みなら予測位置のfawstart1のみ確認し、ブロック間は探索しない
+        const int64_t posExpected = input.nextBlock() - (int64_t)input.inputOffset();
+        if (posExpected >= 0 && (uint64_t)input.nextBlock() >= posLimit) {
+            return false;
+        }
+        if (posExpected >= 0 && (size_t)posExpected + fawstart1.size() > input.size()) {
+            return false; // データが足りない
+        }
+        if (posExpected >= 0 && faw_equal<ishalf, upperhalf>(ptr(posExpected), fawstart1.data(), fawstart1.size())) {
+            posStart = (size_t)posExpected;
+        } else {
+            input.setNextBlock(-1); // 同期が外れたので探索に戻る
+        }
+    }
+    if (posStart == RGY_MEMMEM_NOT_FOUND) {
+        posStart = findFAWStart1(0, input.size());
+    }
+    if (posStart == RGY_MEMMEM_NOT_FOUND) {
+        // fawstart1の途中で切れている可能性のある末尾以外は不要なので破棄
+        input.discard(input.size() - std::min(input.size(), fawstart1.size() - 1));
+        return false;
+    }
+    if (input.inputOffset() + posStart >= posLimit) {
+        return false;
+    }
+    // fawstart1より前は不要なので破棄
+    posStart -= input.discard(posStart);
+
+    size_t posFin = RGY_MEMMEM_NOT_FOUND;
+    bool posFinPredicted = false;
+    for (;;) {
+        if (posStart + fawstart1.size() + AAC_HEADER_MIN_SIZE > input.size()) {
+            return false;
+        }
+        parseHeader<ishalf, upperhalf>(input, posStart + fawstart1.size());
+
+        // ADTSヘッダのフレーム長からfawfin1の位置を予測し、そこにあればブロック内の探索は不要
+        if (input.aacFrameSize() >= AAC_HEADER_MIN_SIZE) {
+            const size_t posFinExpected = posStart + fawstart1.size() + input.aacFrameSize() + 4 /*checksum*/;
+            if (posFinExpected + fawfin1.size() > input.size()) {
+                return false; // データが足りない
+            }
+            if (faw_equal<ishalf, upperhalf>(ptr(posFinExpected), fawfin1.data(), fawfin1.size())) {
+                posFin = posFinExpected;
+                posFinPredicted = true;
+                break;
+            }
+        }
+
+        // 前回探索済みの範囲は飛ばし、最大ブロック長の範囲でfawfin1を探索する
+        const size_t posFinSearchStart = std::max(posStart + fawstart1.size(), input.scanned());
+        const size_t posFinSearchEnd = std::min(posStart + FAW_BLOCK_MAX_SIZE, input.size());
+        if (posFinSearchStart < posFinSearchEnd) {
+            const auto ret = findFAWFin1(posFinSearchStart, posFinSearchEnd - posFinSearchStart);
+            if (ret != RGY_MEMMEM_NOT_FOUND) {
+                posFin = posFinSearchStart + ret; // データの先頭からの位置に変更
+                break;
+            }
+        }
+        // fawfin1の途中で切れている可能性のある末尾は次回再探索する
+        input.setScanned(std::max(posStart + fawstart1.size(), posFinSearchEnd - std::min(posFinSearchEnd, fawfin1.size() - 1)));
+        if (posFinSearchEnd < posStart + FAW_BLOCK_MAX_SIZE) {
+            return false; // データが足りない
+        }
+        // 最大ブロック長の範囲にfawfin1がないので、このfawstart1は無効
+        const auto ret = findFAWStart1(posStart + fawstart1.size(), input.size() - posStart - fawstart1.size());
+        if (ret == RGY_MEMMEM_NOT_FOUND) {
+            input.discard(input.size() - std::min(input.size(), fawstart1.size() - 1));
+            return false;
+        }
+        posStart += ret + fawstart1.size();
+        if (input.inputOffset() + posStart >= posLimit) {
+            return false;
+        }
+        posStart -= input.discard(posStart);
+    }
 
     // pos_start から pos_fin までの間に、別のfawstart1がないか探索する
-    while (posStart + fawstart1.size() < posFin) {
-        auto ret = funcMemMemFAWStart1(input.data() + posStart + fawstart1.size(), posFin - posStart - fawstart1.size());
+    while (!posFinPredicted && posStart + fawstart1.size() < posFin) {
+        auto ret = findFAWStart1(posStart + fawstart1.size(), posFin - posStart - fawstart1.size());
         if (ret == RGY_MEMMEM_NOT_FOUND) {
             break;
         }
         posStart += ret + fawstart1.size();
-        input.parseAACHeader(input.data() + posStart + fawstart1.size());
+        parseHeader<ishalf, upperhalf>(input, posStart + fawstart1.size());
     }
 
+    block.posStart = posStart;
+    block.posFin = posFin;
+    block.valid = false;
     if (posStart + fawstart1.size() + 4 >= posFin) {
-        // 無効なブロックなので破棄
-        input.addOffset(posFin + fawfin1.size());
-        return 1;
+        return true; // 無効なブロック
     }
     const size_t blockSize = posFin - posStart - fawstart1.size() - 4 /*checksum*/;
-    const uint32_t checksumCalc = faw_checksum_calc(input.data() + posStart + fawstart1.size(), blockSize);
-    const uint32_t checksumRead = faw_checksum_read(input.data() + posFin - 4);
+    uint32_t checksumCalc = 0;
+    const uint8_t *blockData = readBlock<ishalf, upperhalf>(input, block, &checksumCalc);
+    const uint32_t checksumRead = faw_checksum_read(blockData + blockSize);
     // checksumとフレーム長が一致しない場合、そのデータは破棄
-    if (checksumCalc != checksumRead || blockSize != input.aacFrameSize()) {
-        input.addOffset(posFin + fawfin1.size());
-        return 1;
+    block.valid = checksumCalc == checksumRead && blockSize == input.aacFrameSize();
+    return true;
+}
+
+// inputは変更せずに先頭から探索し、最初の有効なブロックの位置を返す
+template<bool ishalf, bool upperhalf>
+size_t RGYFAWDecoder::findValidBlock(const RGYFAWBitstream& input) const {
+    RGYFAWBitstream bitstream;
+    bitstream.setBytePerSample(input.bytePerSample());
+    bitstream.setElemSize(input.elemSize());
+    bitstream.setInputOffset(input.inputOffset());
+    bitstream.attach(input.data(), input.size());
+    RGYFAWBlock block;
+    while (findBlock<ishalf, upperhalf>(block, bitstream, std::numeric_limits<uint64_t>::max())) {
+        if (block.valid) {
+            return (size_t)(bitstream.inputOffset() + block.posStart - input.inputOffset());
+        }
+        skipBlock(bitstream, block);
+    }
+    return RGY_MEMMEM_NOT_FOUND;
+}
+
+// ブロックを出力せずに読み進める
+void RGYFAWDecoder::skipBlock(RGYFAWBitstream& input, const RGYFAWBlock& block) const {
+    // 次のブロックは、このブロックの終端以降でAAC_BLOCK_SAMPLES単位の位置にあるはず
+    const size_t blockInterval = AAC_BLOCK_SAMPLES * input.bytePerSample();
+    if (!block.valid) {
+        input.setNextBlock(-1);
+    } else if (blockInterval > 0) {
+        const size_t blockLength = block.posFin + fawfin1.size() - block.posStart;
+        input.setNextBlock(input.inputOffset() + block.posStart + (blockLength + blockInterval - 1) / blockInterval * blockInterval);
+    }
+    input.addOffset(block.posFin + fawfin1.size());
+}
+
+template<bool ishalf, bool upperhalf>
+void RGYFAWDecoder::outputBlock(const RGYFAWFrameSink& sink, const int track, RGYFAWBitstream& input, const RGYFAWBlock& block) {
+    if (!block.valid) {
+        // 無効なブロックなので破棄
+        skipBlock(input, block);
+        return;
     }
 
     // pos_start -> sample start
-    const auto posStartSample = input.inputSampleStart() + posStart / input.bytePerSample();
+    const auto posStartSample = input.inputSampleStart() + block.posStart / input.bytePerSample();
     //fprintf(stderr, "Found block: %lld\n", posStartSample);
 
+    RGYFAWFrame frame;
+    frame.ptr = readBlock<ishalf, upperhalf>(input, block, nullptr);
+    frame.size = block.posFin - block.posStart - fawstart1.size() - 4 /*checksum*/;
+
     // 出力が先行していたらdrop
     if (posStartSample + (AAC_BLOCK_SAMPLES / 2) < input.outputSamples()) {
-        input.addOffset(posFin + fawfin1.size());
-        return 1;
+        frame.sample = posStartSample;
+        frame.flags = RGYFAWFrameFlags::DROPPED;
+        sink(track, frame);
+        skipBlock(input, block);
+        return;
     }
 
     // 時刻ずれを無音データで補正
     while (input.outputSamples() + (AAC_BLOCK_SAMPLES/2) < posStartSample) {
         //fprintf(stderr, "Insert silence: %lld: %lld -> %lld\n", posStartSample, input.outputSamples(), input.outputSamples() + AAC_BLOCK_SAMPLES);
-        addSilent(output, input);
+        addSilent(sink, track, input);
     }
 
-    // ブロックを出力に追加
-    const auto orig_size = output.size();
-    output.resize(orig_size + blockSize);
-    memcpy(output.data() + orig_size, input.data() + posStart + fawstart1.size(), blockSize);
+    // ブロックを出力 (FAW fullでは入力バッファを直接参照する)
+    frame.sample = input.outputSamples();
+    frame.flags = RGYFAWFrameFlags::NONE;
+    sink(track, frame);
     //fprintf(stderr, "Set block: %lld: %lld -> %lld\n", posStartSample, input.outputSamples(), input.outputSamples() + AAC_BLOCK_SAMPLES);
 
     input.addOutputSamples(AAC_BLOCK_SAMPLES);
-    input.addOffset(posFin + fawfin1.size());
-    return 1;
+    skipBlock(input, block);
+}
+
+// ADTSヘッダを読み取る
+template<bool ishalf, bool upperhalf>
+void RGYFAWDecoder::parseHeader(RGYFAWBitstream& input, const size_t pos) const {
+    if (!ishalf) {
+        input.parseAACHeader(input.data() + pos);
+        return;
+    }
+    uint8_t header[AAC_HEADER_MIN_SIZE];
+    faw_read<ishalf, upperhalf>(header, input.data() + pos * 2, sizeof(header));
+    input.parseAACHeader(header);
 }
 
-void RGYFAWDecoder::addSilent(std::vector<uint8_t>& output, RGYFAWBitstream& input) {
+// ブロックのaac + checksum部分を返し、checksumが指定されていればaac部分のchecksumを計算する
+// FAW half/mixでは、参照する8bitのみを取り出してinputのblockBufferに格納する (checksumは取り出しながら計算する)
+template<bool ishalf, bool upperhalf>
+const uint8_t *RGYFAWDecoder::readBlock(RGYFAWBitstream& input, const RGYFAWBlock& block, uint32_t *checksum) const {
+    const size_t pos = block.posStart + fawstart1.size();
+    const size_t blockSize = block.posFin - pos - 4 /*checksum*/;
+    if (!ishalf) {
+        const uint8_t *ptr = input.data() + pos;
+        if (checksum) {
+            *checksum = funcChecksum(ptr, blockSize);
+        }
+        return ptr;
+    }
+    uint8_t *dst = input.blockBuffer(blockSize + 4);
+    const uint32_t checksumCalc = funcReadHalfChecksum(dst, input.data() + pos * 2, blockSize, upperhalf);
+    faw_read<ishalf, upperhalf>(dst + blockSize, input.data() + (pos + blockSize) * 2, 4);
+    if (checksum) {
+        *checksum = checksumCalc;
+    }
+    return dst;
+}
+
+void RGYFAWDecoder::addSilent(const RGYFAWFrameSink& sink, const int track, RGYFAWBitstream& input) {
     auto ptrSilent = aac_silent0.data();
     auto dataSize = aac_silent0.size();
     switch (input.aacChannels()) {
@@ -482,9 +982,12 @@ void RGYFAWDecoder::addSilent(std::vector<uint8_t>& output, RGYFAWBitstream& inp
         dataSize = aac_silent2.size();
         break;
     }
-    const auto orig_size = output.size();
-    output.resize(orig_size + dataSize);
-    memcpy(output.data() + orig_size, ptrSilent, dataSize);
+    RGYFAWFrame frame;
+    frame.ptr = ptrSilent;
+    frame.size = dataSize;
+    frame.sample = input.outputSamples();
+    frame.flags = RGYFAWFrameFlags::SILENT;
+    sink(track, frame);
     input.addOutputSamples(AAC_BLOCK_SAMPLES);
 }
 
@@ -492,32 +995,131 @@ void RGYFAWDecoder::fin(RGYFAWDecoderOutput& output) {
     for (auto& b : output) {
         b.clear();
     }
+    fin(faw_vector_sink(output));
+}
+
+void RGYFAWDecoder::fin(const RGYFAWFrameSink& sink) {
+    // 1サンプルに満たない末尾が残っていれば、最後に処理する
+    if (partialSample.size() > 0) {
+        decodeData(sink, partialSample.data(), partialSample.size());
+        partialSample.clear();
+    }
     if (fawmode == RGYFAWMode::Full) {
-        fin(output[0], bufferIn);
+        fin(sink, 0, bufferIn);
     } else if (fawmode == RGYFAWMode::Half) {
-        fin(output[0], bufferHalf0);
+        fin(sink, 0, bufferHalf0);
     } else if (fawmode == RGYFAWMode::Mix) {
-        fin(output[0], bufferHalf0);
-        fin(output[1], bufferHalf1);
+        fin(sink, 0, bufferHalf0);
+        fin(sink, 1, bufferHalf1);
     }
 }
 
-void RGYFAWDecoder::fin(std::vector<uint8_t>& output, RGYFAWBitstream& input) {
+void RGYFAWDecoder::fin(const RGYFAWFrameSink& sink, const int track, RGYFAWBitstream& input) {
     //fprintf(stderr, "Fin sample: %lld\n", input.inputSampleFin());
     while (input.outputSamples() + (AAC_BLOCK_SAMPLES / 2) < input.inputSampleFin()) {
         //fprintf(stderr, "Insert silence: %lld -> %lld\n", input.outputSamples(), input.outputSamples() + AAC_BLOCK_SAMPLES);
-        addSilent(output, input);
+        addSilent(sink, track, input);
+    }
+}
+
+std::vector<uint8_t> rgy_faw_create_index_chunk(const std::vector<RGYFAWBlockIndex>& index) {
+    std::vector<uint8_t> chunk(8 + index.size() * FAW_INDEX_ENTRY_SIZE);
+    uint8_t *ptr = chunk.data();
+    auto write = [&ptr](const uint64_t value, const int bytes) {
+        for (int i = 0; i < bytes; i++) {
+            *ptr++ = (uint8_t)(value >> (i * 8));
+        }
+    };
+    memcpy(ptr, FAW_INDEX_CHUNK_ID, 4);
+    ptr += 4;
+    write(chunk.size() - 8, 4);
+    for (const auto& entry : index) {
+        write(entry.offset, 8);
+        write(entry.frame, 4);
+        write(entry.size, 4);
+        write(entry.checksum, 4);
+        write(entry.track, 4);
+    }
+    return chunk;
+}
+
+bool rgy_faw_parse_index_chunk(std::vector<RGYFAWBlockIndex>& index, const uint8_t *data, const size_t size) {
+    index.clear();
+    if (size % FAW_INDEX_ENTRY_SIZE != 0) {
+        return false;
+    }
+    auto read = [](const uint8_t *ptr, const int bytes) {
+        uint64_t value = 0;
+        for (int i = 0; i < bytes; i++) {
+            value |= (uint64_t)ptr[i] << (i * 8);
+        }
+        return value;
+    };
+    index.resize(size / FAW_INDEX_ENTRY_SIZE);
+    for (size_t i = 0; i < index.size(); i++) {
+        const uint8_t *ptr = data + i * FAW_INDEX_ENTRY_SIZE;
+        index[i].offset   = read(ptr +  0, 8);
+        index[i].frame    = (uint32_t)read(ptr +  8, 4);
+        index[i].size     = (uint32_t)read(ptr + 12, 4);
+        index[i].checksum = (uint32_t)read(ptr + 16, 4);
+        index[i].track    = (uint32_t)read(ptr + 20, 4);
+    }
+    return true;
+}
+
+size_t rgy_faw_verify_index(const std::vector<RGYFAWBlockIndex>& index, const uint8_t *data, const uint64_t dataSize, const RGYFAWMode mode) {
+    if (mode == RGYFAWMode::Unknown) {
+        return index.size();
     }
+    const auto funcChecksum = get_faw_checksum_func();
+    const auto funcReadHalfChecksum = get_faw_read_half_checksum_func();
+    // FAW half/mixは16bitの上位/下位8bitに入っているので、1byteあたり2byteとなる
+    const bool ishalf = mode != RGYFAWMode::Full;
+    const size_t elemSize = (ishalf) ? sizeof(short) : 1;
+    std::vector<uint8_t> block;
+    size_t broken = 0;
+    for (const auto& entry : index) {
+        const size_t blockSize = fawstart1.size() + entry.size + 4 /*checksum*/;
+        if (entry.offset > dataSize || (dataSize - entry.offset) / elemSize < blockSize) {
+            broken++;
+            continue;
+        }
+        const uint8_t *ptr = data + entry.offset;
+        uint32_t checksumCalc = 0;
+        if (ishalf) {
+            // FAW halfとFAW half size mixの1つめの音声は上位8bit、2つめの音声は下位8bitに入っている
+            const bool upperhalf = entry.track == 0;
+            block.resize(blockSize);
+            funcReadHalfChecksum(block.data(), ptr, fawstart1.size(), upperhalf);
+            checksumCalc = funcReadHalfChecksum(block.data() + fawstart1.size(), ptr + fawstart1.size() * elemSize, entry.size, upperhalf);
+            funcReadHalfChecksum(block.data() + fawstart1.size() + entry.size, ptr + (fawstart1.size() + entry.size) * elemSize, 4, upperhalf);
+            ptr = block.data();
+        } else {
+            checksumCalc = funcChecksum(ptr + fawstart1.size(), entry.size);
+        }
+        if (memcmp(ptr, fawstart1.data(), fawstart1.size()) != 0
+            || checksumCalc != entry.checksum
+            || faw_checksum_read(ptr + fawstart1.size() + entry.size) != entry.checksum) {
+            broken++;
+        }
+    }
+    return broken;
 }
 
 RGYFAWEncoder::RGYFAWEncoder() :
     wavheader(),
     fawmode(),
     delaySamples(0),
+    bytePerWholeSample(0),
     inputAACPosByte(0),
     outputFAWPosByte(0),
     bufferIn(),
-    bufferTmp() {
+    encodeBlocks(),
+    inputFrames(0),
+    indexEnabled(false),
+    blockIndex(),
+    funcFindAACSync(get_find_aacsync_func()),
+    funcCopyChecksum(get_faw_copy_checksum_func()) {
 
 }
 
@@ -528,23 +1130,20 @@ RGYFAWEncoder::~RGYFAWEncoder() {
 int RGYFAWEncoder::init(const RGYWAVHeader *data, const RGYFAWMode mode, const int delayMillisec) {
     wavheader = *data;
     fawmode = mode;
-    bufferTmp.setBytePerSample(wavheader.number_of_channels * wavheader.bits_per_sample / 8);
+    bytePerWholeSample = wavheader.number_of_channels * wavheader.bits_per_sample / 8;
     delaySamples = delayMillisec * (int)wavheader.sample_rate / 1000;
-    inputAACPosByte += delaySamples * bufferTmp.bytePerSample();
+    inputAACPosByte += delaySamples * bytePerWholeSample;
     return 0;
 }
 
-int RGYFAWEncoder::encode(std::vector<uint8_t>& output, const uint8_t *input, const size_t inputLength) {
-    output.clear();
-    bufferTmp.clear();
-
+int RGYFAWEncoder::encode(RGYFAWEncoderOutput& output, const uint8_t *input, const size_t inputLength) {
     if (fawmode == RGYFAWMode::Unknown) {
         return -1;
     }
 
     bufferIn.append(input, inputLength);
 
-    const auto ret = rgy_find_aacsync_c(bufferIn.data(), bufferIn.size());
+    const auto ret = funcFindAACSync(bufferIn.data(), bufferIn.size());
     if (ret == RGY_MEMMEM_NOT_FOUND) {
         return 0;
     }
@@ -552,84 +1151,205 @@ int RGYFAWEncoder::encode(std::vector<uint8_t>& output, const uint8_t *input, co
     return encode(output);
 }
 
-int RGYFAWEncoder::encode(std::vector<uint8_t>& output) {
+int RGYFAWEncoder::encode(RGYFAWEncoderOutput& output) {
+    uint64_t outputLength = 0;
+    const size_t inputLength = scanBlocks(outputLength);
+    if (encodeBlocks.empty()) {
+        bufferIn.addOffset(inputLength);
+        return 0;
+    }
+
+    // 出力が空の場合、最初のブロックの前の0は長さのみ保持する (遅延が大きくてもメモリを使わないように)
+    uint64_t firstPadding = encodeBlocks.front().padding;
+    if (output.data.empty() && output.zeroTail == 0) {
+        output.zeroHead += firstPadding;
+        outputLength -= firstPadding;
+        firstPadding = 0;
+    }
+
+    // 出力先を一度だけ確保し、直接書き込む (0で埋める部分は確保時に0になっている)
+    const size_t outputOffset = output.data.size();
+    output.data.resize(outputOffset + (size_t)outputLength);
+    RGYFAWBlockIndex *index = nullptr;
+    if (indexEnabled) {
+        const size_t indexOffset = blockIndex.size();
+        blockIndex.resize(indexOffset + encodeBlocks.size());
+        index = blockIndex.data() + indexOffset;
+    }
+    writeBlocks(output.data.data() + outputOffset + (size_t)firstPadding, bufferIn.data(), encodeBlocks.data(), encodeBlocks.size(), index);
+    bufferIn.addOffset(inputLength);
+    return 0;
+}
+
+// bufferInから今回出力するブロックを列挙し、encodeBlocksに格納する
+// outputLengthには出力の長さ(ブロック前の0を含む)、戻り値は処理したbufferInのbyte数
+// listBlocks = falseの場合は列挙せず、位置のみ進める
+size_t RGYFAWEncoder::scanBlocks(uint64_t& outputLength, const bool listBlocks) {
+    encodeBlocks.clear();
+    outputLength = 0;
     if (bufferIn.size() < AAC_HEADER_MIN_SIZE) {
         return 0;
     }
+    // 次のADTSヘッダはフレーム長の位置にあるはずなので、そこになかった場合(壊れている場合)のみ探索する
+    auto findNextSync = [&](const size_t pos) {
+        const uint8_t *ptr = bufferIn.data() + pos;
+        if (pos + AACSYNC_BYTES.size() <= bufferIn.size()
+            && ptr[0] == AACSYNC_BYTES[0] && (ptr[1] & AACSYNC_BYTES[1]) == AACSYNC_BYTES[1]) {
+            return (size_t)0;
+        }
+        return funcFindAACSync(ptr, bufferIn.size() - pos);
+    };
+
+    size_t pos = 0; // 現在のADTSフレームの位置
     bufferIn.parseAACHeader(bufferIn.data());
     auto aacBlockSize = bufferIn.aacFrameSize();
     if (aacBlockSize > bufferIn.size()) {
         return 0;
     }
-    auto ret0 = rgy_find_aacsync_c(bufferIn.data() + aacBlockSize, bufferIn.size() - aacBlockSize);
+    auto ret0 = findNextSync(aacBlockSize);
     while (ret0 != RGY_MEMMEM_NOT_FOUND) {
         ret0 += aacBlockSize;
         if (inputAACPosByte < outputFAWPosByte) {
             ; // このブロックを破棄
         } else {
-            if (outputFAWPosByte < inputAACPosByte) {
-                const auto offsetBytes = inputAACPosByte - outputFAWPosByte;
-                const auto origSize = bufferTmp.size();
-                bufferTmp.append(nullptr, (size_t)offsetBytes);
-                memset(bufferTmp.data() + origSize, 0, (size_t)offsetBytes);
-                outputFAWPosByte = inputAACPosByte;
+            // outputWavPosSample == inputAACPosSample となるよう、0で埋めてから出力
+            const uint64_t padding = (uint64_t)(inputAACPosByte - outputFAWPosByte);
+            const size_t blockLength = fawstart1.size() + aacBlockSize + 4 /*checksum*/ + fawfin1.size();
+            if (listBlocks) {
+                encodeBlocks.push_back({ pos, aacBlockSize, padding, (uint64_t)inputAACPosByte, inputFrames });
             }
-            // outputWavPosSample == inputAACPosSample
-            encodeBlock(bufferIn.data(), aacBlockSize);
+            outputLength += padding + blockLength;
+            outputFAWPosByte = inputAACPosByte + blockLength;
         }
-        inputAACPosByte += AAC_BLOCK_SAMPLES * bufferTmp.bytePerSample();
+        inputAACPosByte += AAC_BLOCK_SAMPLES * bytePerWholeSample;
+        inputFrames++;
 
-        bufferIn.addOffset(ret0);
-        if (bufferIn.size() < AAC_HEADER_MIN_SIZE) {
+        pos += ret0;
+        if (bufferIn.size() - pos < AAC_HEADER_MIN_SIZE) {
             break;
         }
-        bufferIn.parseAACHeader(bufferIn.data());
+        bufferIn.parseAACHeader(bufferIn.data() + pos);
         aacBlockSize = bufferIn.aacFrameSize();
-        if (aacBlockSize > bufferIn.size()) {
+        if (aacBlockSize > bufferIn.size() - pos) {
             break;
         }
-        ret0 = rgy_find_aacsync_c(bufferIn.data() + aacBlockSize, bufferIn.size() - aacBlockSize);
+        ret0 = findNextSync(pos + aacBlockSize);
     }
+    return pos;
+}
 
-    output.resize(bufferTmp.size());
-    memcpy(output.data(), bufferTmp.data(), bufferTmp.size());
-    bufferTmp.clear();
-    return 0;
+// dstの先頭に最初のブロックを書き込み、以降のブロックはpaddingを空けて続けて書き込む (paddingの部分は0で初期化されている必要がある)
+// ブロックのposはdataからの位置
+void RGYFAWEncoder::writeBlocks(uint8_t *dst, const uint8_t *data, const RGYFAWEncodeBlock *blocks, const size_t count, RGYFAWBlockIndex *index) const {
+    uint8_t *ptr = dst;
+    for (size_t i = 0; i < count; i++) {
+        if (i > 0) {
+            ptr += blocks[i].padding;
+        }
+        memcpy(ptr, fawstart1.data(), fawstart1.size());
+        ptr += fawstart1.size();
+        // aacをコピーしながらchecksumを計算する
+        const uint32_t checksumCalc = funcCopyChecksum(ptr, data + blocks[i].pos, blocks[i].size);
+        ptr += blocks[i].size;
+        memcpy(ptr, &checksumCalc, sizeof(checksumCalc));
+        ptr += sizeof(checksumCalc);
+        memcpy(ptr, fawfin1.data(), fawfin1.size());
+        ptr += fawfin1.size();
+        if (index) {
+            index[i] = { blocks[i].outputPos, blocks[i].frame, (uint32_t)blocks[i].size, checksumCalc, 0 };
+        }
+    }
 }
 
-void RGYFAWEncoder::encodeBlock(const uint8_t *data, const size_t dataLength) {
-    const uint32_t checksumCalc = faw_checksum_calc(data, dataLength);
+// 入力全体がメモリ上にある場合に、出力するブロックとその出力位置をすべて求める
+// 各ブロックは出力位置が決まっているので、writeBlocks()で並列に書き込むことができる
+// 戻り値はencode()/fin()で出力される全体の長さ
+uint64_t RGYFAWEncoder::layout(std::vector<RGYFAWEncodeBlock>& blocks, const uint8_t *data, const size_t dataLength) {
+    return layout(&blocks, data, dataLength, nullptr);
+}
 
-    bufferTmp.append(fawstart1.data(), fawstart1.size());
-    outputFAWPosByte += fawstart1.size();
+// 出力の長さはブロックの位置のみで決まるので、ブロックを列挙せずに求める
+// (出力の先頭にwavヘッダを書き込んでから、そのまま出力する場合に使用する)
+uint64_t RGYFAWEncoder::measure(const uint8_t *data, const size_t dataLength, uint64_t *encodeLength) {
+    return layout(nullptr, data, dataLength, encodeLength);
+}
 
-    bufferTmp.append(data, dataLength);
-    outputFAWPosByte += dataLength;
+uint64_t RGYFAWEncoder::layout(std::vector<RGYFAWEncodeBlock> *blocks, const uint8_t *data, const size_t dataLength, uint64_t *encodeLength) {
+    if (blocks) {
+        blocks->clear();
+    }
+    if (encodeLength) {
+        *encodeLength = 0;
+    }
+    if (fawmode == RGYFAWMode::Unknown) {
+        return 0;
+    }
+    auto addBlocks = [&](const size_t inputOffset) {
+        if (!blocks) {
+            return;
+        }
+        for (auto block : encodeBlocks) {
+            block.pos += inputOffset;
+            blocks->push_back(block);
+        }
+    };
+    uint64_t outputLength = 0;
+    bufferIn.attach(data, dataLength);
+    const auto ret = funcFindAACSync(bufferIn.data(), bufferIn.size());
+    if (ret != RGY_MEMMEM_NOT_FOUND) {
+        bufferIn.addOffset(ret);
+        const size_t inputOffset = dataLength - bufferIn.size();
+        bufferIn.addOffset(scanBlocks(outputLength, blocks != nullptr));
+        addBlocks(inputOffset);
+    }
+    // fin()までに出力される長さ
+    const uint64_t outputLengthEncode = outputFAWPosByte;
+    if (encodeLength) {
+        *encodeLength = outputLengthEncode;
+    }
 
-    bufferTmp.append((const uint8_t *)&checksumCalc, sizeof(checksumCalc));
-    outputFAWPosByte += sizeof(checksumCalc);
+    // 最後のフレームは、fin()と同様に末尾にsyncwordを追加して探索する
+    const size_t inputOffset = dataLength - bufferIn.size();
+    bufferIn.detach();
+    bufferIn.append(AACSYNC_BYTES.data(), AACSYNC_BYTES.size());
+    bufferIn.addOffset(scanBlocks(outputLength, blocks != nullptr));
+    addBlocks(inputOffset);
+    bufferIn.clear();
 
-    bufferTmp.append(fawfin1.data(), fawfin1.size());
-    outputFAWPosByte += fawfin1.size();
+    // 残りは0で調整 (fin()と同様)
+    uint64_t outputLengthTotal = (uint64_t)std::max(outputFAWPosByte, inputAACPosByte);
+    if (delaySamples < 0) {
+        outputLengthTotal += -1 * delaySamples * bytePerWholeSample;
+    }
+    //最終出力は4byte少ない (fin()と同様)
+    if (outputLengthTotal - outputLengthEncode > 4) {
+        outputLengthTotal -= 4;
+    }
+    return outputLengthTotal;
 }
 
-int RGYFAWEncoder::fin(std::vector<uint8_t>& output) {
-    output.clear();
+int RGYFAWEncoder::fin(RGYFAWEncoderOutput& output) {
+    const uint64_t outputOffset = output.size();
     bufferIn.append(AACSYNC_BYTES.data(), AACSYNC_BYTES.size());
     auto ret = encode(output);
     if (outputFAWPosByte < inputAACPosByte) {
         // 残りのbyteを0で調整
-        const auto offsetBytes = inputAACPosByte - outputFAWPosByte;
-        output.resize(output.size() + (size_t)offsetBytes, 0);
+        output.zeroTail += inputAACPosByte - outputFAWPosByte;
     }
     if (delaySamples < 0) {
         // 負のdelayの場合、wavの長さを合わせるために0で埋める
-        const auto offsetBytes = -1 * delaySamples * bufferTmp.bytePerSample();
-        output.resize(output.size() + offsetBytes, 0);
+        output.zeroTail += -1 * delaySamples * bytePerWholeSample;
     }
     //最終出力は4byte少ない (先頭に4byte入れたためと思われる)
-    if (output.size() > 4) {
-        output.resize(output.size() - 4);
+    if (output.size() - outputOffset > 4) {
+        uint64_t trim = 4;
+        const auto trimTail = std::min(trim, output.zeroTail);
+        output.zeroTail -= trimTail;
+        trim -= trimTail;
+        const auto trimData = std::min<uint64_t>(trim, output.data.size());
+        output.data.resize(output.data.size() - (size_t)trimData);
+        trim -= trimData;
+        output.zeroHead -= trim;
     }
     return ret;
 }
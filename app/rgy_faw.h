@@ -31,6 +31,8 @@
 #include <cstdint>
 #include <array>
 #include <vector>
+#include <functional>
+#include <algorithm>
 #include "rgy_wav_parser.h"
 #include "rgy_memmem.h"
 
@@ -50,19 +52,103 @@ static const std::array<uint8_t, 24> fawfin2 = {
     0x00, 0x80, 0x00, 0x80, 0x00, 0x80, 0x00, 0x80,
     0x00, 0xC5, 0x00, 0xCE, 0x00, 0xC4, 0x00, 0x80
 };
+static const std::array<uint8_t, 2> AACSYNC_BYTES = { 0xff, 0xf0 };
 
 size_t rgy_memmem_fawstart1_c(const void *data_, const size_t data_size);
 size_t rgy_memmem_fawstart1_avx2(const void *data_, const size_t data_size);
 size_t rgy_memmem_fawstart1_avx512bw(const void *data_, const size_t data_size);
 
-void rgy_convert_audio_16to8(uint8_t *dst, const short *src, const size_t n);
-void rgy_convert_audio_16to8_avx2(uint8_t *dst, const short *src, const size_t n);
+// data_をdata_size個の16bit値とし、その上位/下位8bitから(値-128)がtarget_と一致する位置を探す
+size_t rgy_memmem_faw_half_c(const void *data_, const size_t data_size, const void *target_, const size_t target_size, const bool upperhalf);
+size_t rgy_memmem_faw_half_avx2(const void *data_, const size_t data_size, const void *target_, const size_t target_size, const bool upperhalf);
+size_t rgy_memmem_faw_half_avx512bw(const void *data_, const size_t data_size, const void *target_, const size_t target_size, const bool upperhalf);
 
-void rgy_split_audio_16to8x2(uint8_t *dst0, uint8_t *dst1, const short *src, const size_t n);
-void rgy_split_audio_16to8x2_avx2(uint8_t *dst0, uint8_t *dst1, const short *src, const size_t n);
+// ADTSヘッダのsyncword(0xFFF)を探す
+size_t rgy_find_aacsync_c(const void *data_, const size_t data_size);
+size_t rgy_find_aacsync_avx2(const void *data_, const size_t data_size);
+size_t rgy_find_aacsync_avx512bw(const void *data_, const size_t data_size);
+
+// aacのchecksumを計算する
+uint32_t rgy_faw_checksum_c(const uint8_t *data, const size_t data_size);
+uint32_t rgy_faw_checksum_avx2(const uint8_t *data, const size_t data_size);
+uint32_t rgy_faw_checksum_avx512bw(const uint8_t *data, const size_t data_size);
+
+// srcをdstにコピーしながら、checksumを計算する
+uint32_t rgy_faw_copy_checksum_c(uint8_t *dst, const uint8_t *src, const size_t size);
+uint32_t rgy_faw_copy_checksum_avx2(uint8_t *dst, const uint8_t *src, const size_t size);
+uint32_t rgy_faw_copy_checksum_avx512bw(uint8_t *dst, const uint8_t *src, const size_t size);
+
+// src_をsize個の16bit値とし、その上位/下位8bitをdstに取り出しながら、checksumを計算する
+uint32_t rgy_faw_read_half_checksum_c(uint8_t *dst, const void *src_, const size_t size, const bool upperhalf);
+uint32_t rgy_faw_read_half_checksum_avx2(uint8_t *dst, const void *src_, const size_t size, const bool upperhalf);
+uint32_t rgy_faw_read_half_checksum_avx512bw(uint8_t *dst, const void *src_, const size_t size, const bool upperhalf);
+
+// 2つの8bit音声をFAW mixの16bit値にする (src0を上位8bit、src1を下位8bitとし、それぞれ(値-128)を入れる)
+void rgy_merge_audio_8x2to16_c(uint16_t *dst, const uint8_t *src0, const uint8_t *src1, const size_t n);
+void rgy_merge_audio_8x2to16_avx2(uint16_t *dst, const uint8_t *src0, const uint8_t *src1, const size_t n);
+void rgy_merge_audio_8x2to16_avx512bw(uint16_t *dst, const uint8_t *src0, const uint8_t *src1, const size_t n);
+decltype(rgy_merge_audio_8x2to16_c)* get_merge_audio_8x2to16_func();
+
+// checksumは16bit単位の加算とxorで、奇数長の場合は最後の1byteをそのまま加える
+// sum/xorに途中までの結果を渡し、posから残りの部分を計算する
+static RGY_FORCEINLINE uint32_t faw_checksum_tail(uint32_t sum, uint32_t xor_, const uint8_t *data, size_t pos, const size_t data_size) {
+    for (; pos + 2 <= data_size; pos += 2) {
+        uint16_t v;
+        memcpy(&v, data + pos, sizeof(v));
+        sum += v;
+        xor_ ^= v;
+    }
+    if (pos < data_size) {
+        sum += data[pos];
+        xor_ ^= data[pos];
+    }
+    return (sum & 0xffff) | ((xor_ & 0xffff) << 16);
+}
+
+// FAW half/mixでは、16bitの上位/下位8bitに(値+128)が入っている
+template<bool upperhalf>
+static RGY_FORCEINLINE uint8_t faw_read_half(const uint16_t v) {
+    uint8_t i = (upperhalf) ? (v & 0xff00) >> 8 : (v & 0xff);
+    return i - 0x80;
+}
+
+static RGY_FORCEINLINE bool faw_half_equal(const uint16_t *data, const uint8_t *target, const size_t target_size, const bool upperhalf) {
+    for (size_t i = 0; i < target_size; i++) {
+        const uint8_t v = (upperhalf) ? faw_read_half<true>(data[i]) : faw_read_half<false>(data[i]);
+        if (v != target[i]) {
+            return false;
+        }
+    }
+    return true;
+}
 
 using RGYFAWDecoderOutput = std::array<std::vector<uint8_t>, 2>;
 
+enum class RGYFAWFrameFlags : uint32_t {
+    NONE    = 0x00,
+    SILENT  = 0x01, // 時刻ずれを補正するために挿入した無音
+    DROPPED = 0x02, // 出力が先行しているため破棄したブロック
+};
+
+static RGYFAWFrameFlags operator|(RGYFAWFrameFlags a, RGYFAWFrameFlags b) {
+    return (RGYFAWFrameFlags)((uint32_t)a | (uint32_t)b);
+}
+
+static RGYFAWFrameFlags operator&(RGYFAWFrameFlags a, RGYFAWFrameFlags b) {
+    return (RGYFAWFrameFlags)((uint32_t)a & (uint32_t)b);
+}
+
+struct RGYFAWFrame {
+    const uint8_t *ptr;     // ADTSフレームの先頭 (コールバックの中でのみ有効)
+    size_t size;            // ADTSフレームの長さ
+    uint64_t sample;        // 出力上の開始サンプル (DROPPEDの場合は入力上の位置)
+    RGYFAWFrameFlags flags;
+};
+
+// track ... FAW half size mixの場合、0/1 でどちらの音声か、それ以外は常に0
+// FAW half size mixで複数スレッドを指定した場合、trackごとに別のスレッドから同時に呼ばれる
+using RGYFAWFrameSink = std::function<void(const int track, const RGYFAWFrame& frame)>;
+
 enum class RGYFAWMode {
     Unknown,
     Full,
@@ -72,6 +158,65 @@ enum class RGYFAWMode {
 
 static const int AAC_HEADER_MIN_SIZE = 7;
 static const uint32_t AAC_BLOCK_SAMPLES = 1024;
+static const uint32_t AAC_FRAME_MAX_SIZE = 8191; // aac_frame_lengthは13bit
+// fawstart1 + aac + checksum + fawfin1 の最大長
+static const size_t FAW_BLOCK_MAX_SIZE = fawstart1.size() + AAC_FRAME_MAX_SIZE + 4 + fawfin1.size();
+
+// 見つかったブロックの位置 (data()からのbyte数)
+struct RGYFAWBlock {
+    size_t posStart; // fawstart1の位置
+    size_t posFin;   // fawfin1の位置
+    bool valid;      // checksumとフレーム長が一致したか
+};
+
+// エンコーダの出力
+// 遅延による大きな0の連続はメモリ上に展開せず、長さのみを保持する
+struct RGYFAWEncoderOutput {
+    uint64_t zeroHead;         // dataの前に続く0の長さ
+    std::vector<uint8_t> data;
+    uint64_t zeroTail;         // dataの後に続く0の長さ (fin()でのみ設定される)
+
+    RGYFAWEncoderOutput() : zeroHead(0), data(), zeroTail(0) {};
+    uint64_t size() const { return zeroHead + data.size() + zeroTail; }
+    void clear() { zeroHead = 0; data.clear(); zeroTail = 0; }
+};
+
+// エンコーダで出力するブロック
+struct RGYFAWEncodeBlock {
+    size_t pos;          // aacの位置 (入力のbyte数)
+    size_t size;         // aacの長さ
+    uint64_t padding;    // ブロックの前に0で埋めるbyte数
+    uint64_t outputPos;  // fawstart1の出力位置 (出力の先頭からのbyte数)
+    uint32_t frame;      // 入力のADTSフレームの番号 (先頭を0とする)
+};
+
+// 出力した各ブロックの位置
+// wavのdata chunkの後ろに"fawi" chunkとして出力し、先頭から探索せずに任意のブロックを読めるようにする
+struct RGYFAWBlockIndex {
+    uint64_t offset;     // fawstart1の位置 (エンコーダでは出力の先頭から、chunkではdata chunkの先頭からのbyte数)
+    uint32_t frame;      // 入力のADTSフレームの番号
+    uint32_t size;       // aacの長さ
+    uint32_t checksum;
+    uint32_t track;      // FAW mixの場合 0:上位8bit 1:下位8bit
+};
+
+static const char FAW_INDEX_CHUNK_ID[] = "fawi";
+static const size_t FAW_INDEX_ENTRY_SIZE = 24; // offset(8) + frame, size, checksum, track(各4), little endian
+
+// "fawi" chunkを作成する (chunk idと長さを含む)
+std::vector<uint8_t> rgy_faw_create_index_chunk(const std::vector<RGYFAWBlockIndex>& index);
+// "fawi" chunkの中身(chunk idと長さを除く)を読み取る
+bool rgy_faw_parse_index_chunk(std::vector<RGYFAWBlockIndex>& index, const uint8_t *data, const size_t size);
+// indexの各ブロックが、data chunkの中身(data)の示す位置にあり、checksumが一致するか確認する
+// 一致しなかったブロックの数を返す
+size_t rgy_faw_verify_index(const std::vector<RGYFAWBlockIndex>& index, const uint8_t *data, const uint64_t dataSize, const RGYFAWMode mode);
+
+// 並列探索で見つかったブロックの位置 (入力の先頭からのbyte数)
+struct RGYFAWBlockPos {
+    uint64_t start;
+    uint64_t fin;
+    bool valid;
+};
 
 struct RGYAACHeader {
     bool id;
@@ -95,45 +240,67 @@ struct RGYAACHeader {
 class RGYFAWBitstream {
 private:
     std::vector<uint8_t> buffer;
+    uint8_t *bufferExt; // bufferの代わりに参照している外部のデータ
     size_t bufferOffset;
     size_t bufferLength;
+    size_t scannedLength; // data()から探索済みのbyte数
 
     int bytePerWholeSample; // channels * bits per sample
+    int inputElemSize; // data()の1byteに対応する入力のbyte数 (FAW half/mixでは16bitの上位/下位8bitのみを使うので2)
     uint64_t inputLengthByte;
     uint64_t outSamples;
+    int64_t nextBlockPos; // 同期済みの場合、次のブロックの予測位置 (入力の先頭からのbyte数)、未同期なら-1
 
     RGYAACHeader aacHeader;
+    std::vector<uint8_t> blockData; // FAW half/mixで取り出したブロック
 public:
     RGYFAWBitstream();
     ~RGYFAWBitstream();
 
     void setBytePerSample(const int val);
+    void setElemSize(const int val);
+    void setInputOffset(const uint64_t offset) { inputLengthByte = offset + bufferLength; }
 
-    uint8_t *data() { return buffer.data() + bufferOffset; }
-    const uint8_t *data() const { return buffer.data() + bufferOffset; }
+    uint8_t *data() { return ((bufferExt) ? bufferExt : buffer.data()) + bufferOffset * inputElemSize; }
+    const uint8_t *data() const { return ((bufferExt) ? bufferExt : buffer.data()) + bufferOffset * inputElemSize; }
     size_t size() const { return bufferLength; }
     uint64_t inputLength() const { return inputLengthByte; }
+    uint64_t inputOffset() const { return inputLengthByte - bufferLength; }
     uint64_t inputSampleStart() const { return (inputLengthByte - bufferLength) / bytePerWholeSample; }
     uint64_t inputSampleFin() const { return inputLengthByte / bytePerWholeSample; }
     uint64_t outputSamples() const { return outSamples; }
     int bytePerSample() const { return bytePerWholeSample; }
+    int elemSize() const { return inputElemSize; }
+    size_t scanned() const { return scannedLength; }
+    void setScanned(size_t length) { scannedLength = length; }
+    int64_t nextBlock() const { return nextBlockPos; }
+    void setNextBlock(int64_t pos) { nextBlockPos = pos; }
 
     void addOffset(size_t offset);
+    size_t discard(size_t length);
     void addOutputSamples(size_t samples);
 
     void append(const uint8_t *input, const size_t inputLength);
+    void appendTail(const uint8_t *input, const size_t inputLength, const size_t keepLength);
+    void attach(const uint8_t *input, const size_t inputLength);
+    void detach();
 
     void clear();
 
     void parseAACHeader(const uint8_t *buffer);
     uint32_t aacChannels() const;
     uint32_t aacFrameSize() const;
+
+    uint8_t *blockBuffer(const size_t size);
 };
 
 class RGYFAWDecoder {
 private:
     RGYWAVHeader wavheader;
     RGYFAWMode fawmode;
+    int threads;
+    uint64_t dataRemain; // data chunkの残りの長さ (data chunkの後ろに別のchunkがある場合のみ制限する)
+    std::vector<uint8_t> partialSample; // 入力がサンプルの途中で切れていた場合の残り (次の入力の先頭に連結する)
 
     RGYFAWBitstream bufferIn;
 
@@ -142,26 +309,38 @@ private:
 
     decltype(rgy_memmem_c)* funcMemMem;
     decltype(rgy_memmem_fawstart1_c)* funcMemMemFAWStart1;
-    decltype(rgy_convert_audio_16to8)* funcAudio16to8;
-    decltype(rgy_split_audio_16to8x2)* funcSplitAudio16to8x2;
+    decltype(rgy_memmem_faw_half_c)* funcMemMemHalf;
+    decltype(rgy_faw_checksum_c)* funcChecksum;
+    decltype(rgy_faw_read_half_checksum_c)* funcReadHalfChecksum;
 public:
     RGYFAWDecoder();
     ~RGYFAWDecoder();
 
     RGYFAWMode mode() const { return fawmode; }
+    void setThreads(const int val) { threads = std::max(val, 1); }
     int init(const uint8_t *data);
     int init(const RGYWAVHeader *data);
     int decode(RGYFAWDecoderOutput& output, const uint8_t *data, const size_t dataLength);
     void fin(RGYFAWDecoderOutput& output);
+    // 出力をコピーせず、ADTSフレーム単位でsinkに渡す
+    int decode(const RGYFAWFrameSink& sink, const uint8_t *data, const size_t dataLength);
+    void fin(const RGYFAWFrameSink& sink);
 private:
-    void appendFAWHalf(const uint8_t *data, const size_t dataLength);
-    void appendFAWMix(const uint8_t *data, const size_t dataLength);
-
     void setWavInfo();
-    int decode(std::vector<uint8_t>& output, RGYFAWBitstream& input);
-    int decodeBlock(std::vector<uint8_t>& output, RGYFAWBitstream& input);
-    void addSilent(std::vector<uint8_t>& output, RGYFAWBitstream& input);
-    void fin(std::vector<uint8_t>& output, RGYFAWBitstream& input);
+    int decodeData(const RGYFAWFrameSink& sink, const uint8_t *data, const size_t dataLength);
+    int decodeDirect(const RGYFAWFrameSink& sink, const int track, RGYFAWBitstream& bitstream, const uint8_t *data, const size_t dataLength);
+    int decode(const RGYFAWFrameSink& sink, const int track, RGYFAWBitstream& input);
+    template<bool ishalf, bool upperhalf> int decodeTrack(const RGYFAWFrameSink& sink, const int track, RGYFAWBitstream& input);
+    template<bool ishalf, bool upperhalf> int decodeParallel(const RGYFAWFrameSink& sink, const int track, RGYFAWBitstream& input, const int threads);
+    template<bool ishalf, bool upperhalf> int decodeBlock(const RGYFAWFrameSink& sink, const int track, RGYFAWBitstream& input);
+    template<bool ishalf, bool upperhalf> bool findBlock(RGYFAWBlock& block, RGYFAWBitstream& input, const uint64_t posLimit) const;
+    template<bool ishalf, bool upperhalf> size_t findValidBlock(const RGYFAWBitstream& input) const;
+    void skipBlock(RGYFAWBitstream& input, const RGYFAWBlock& block) const;
+    template<bool ishalf, bool upperhalf> void outputBlock(const RGYFAWFrameSink& sink, const int track, RGYFAWBitstream& input, const RGYFAWBlock& block);
+    template<bool ishalf, bool upperhalf> void parseHeader(RGYFAWBitstream& input, const size_t pos) const;
+    template<bool ishalf, bool upperhalf> const uint8_t *readBlock(RGYFAWBitstream& input, const RGYFAWBlock& block, uint32_t *checksum) const;
+    void addSilent(const RGYFAWFrameSink& sink, const int track, RGYFAWBitstream& input);
+    void fin(const RGYFAWFrameSink& sink, const int track, RGYFAWBitstream& input);
 };
 
 class RGYFAWEncoder {
@@ -170,20 +349,38 @@ private:
     RGYFAWMode fawmode;
     int delaySamples;
 
+    int bytePerWholeSample; // channels * bits per sample
     int64_t inputAACPosByte;
     int64_t outputFAWPosByte;
     RGYFAWBitstream bufferIn;
-    RGYFAWBitstream bufferTmp;
+    std::vector<RGYFAWEncodeBlock> encodeBlocks;
+    uint32_t inputFrames; // 入力したADTSフレームの数
+    bool indexEnabled;
+    std::vector<RGYFAWBlockIndex> blockIndex;
+
+    decltype(rgy_find_aacsync_c)* funcFindAACSync;
+    decltype(rgy_faw_copy_checksum_c)* funcCopyChecksum;
 public:
     RGYFAWEncoder();
     ~RGYFAWEncoder();
 
     int init(const RGYWAVHeader *data, const RGYFAWMode mode, const int delayMillisec);
-    int encode(std::vector<uint8_t>& output, const uint8_t *data, const size_t dataLength);
-    int fin(std::vector<uint8_t>& output);
+    // 出力はoutputの末尾に追加する
+    int encode(RGYFAWEncoderOutput& output, const uint8_t *data, const size_t dataLength);
+    int fin(RGYFAWEncoderOutput& output);
+    // 入力全体から出力するブロックを列挙し、出力全体の長さを返す (ブロックごとに並列に書き込む場合に使用する)
+    uint64_t layout(std::vector<RGYFAWEncodeBlock>& blocks, const uint8_t *data, const size_t dataLength);
+    // indexを指定した場合は、各ブロックの位置をindexに格納する
+    void writeBlocks(uint8_t *dst, const uint8_t *data, const RGYFAWEncodeBlock *blocks, const size_t count, RGYFAWBlockIndex *index = nullptr) const;
+    // 入力全体から出力全体の長さのみを求める (encodeLengthにはfin()の前までに出力される長さを返す)
+    uint64_t measure(const uint8_t *data, const size_t dataLength, uint64_t *encodeLength);
+    // encode()/fin()で出力したブロックの位置を記録する
+    void setIndex(const bool enable) { indexEnabled = enable; }
+    std::vector<RGYFAWBlockIndex>& index() { return blockIndex; }
 private:
-    int encode(std::vector<uint8_t>& output);
-    void encodeBlock(const uint8_t *data, const size_t dataLength);
+    int encode(RGYFAWEncoderOutput& output);
+    size_t scanBlocks(uint64_t& outputLength, const bool listBlocks = true);
+    uint64_t layout(std::vector<RGYFAWEncodeBlock> *blocks, const uint8_t *data, const size_t dataLength, uint64_t *encodeLength);
 };
 
 #endif //__RGY_FAW_H__
\ No newline at end of file
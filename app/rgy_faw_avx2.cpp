@@ -34,65 +34,158 @@ size_t rgy_memmem_fawstart1_avx2(const void *data_, const size_t data_size) {
     return rgy_memmem_avx2_imp(data_, data_size, fawstart1.data(), fawstart1.size());
 }
 
-void rgy_convert_audio_16to8_avx2(uint8_t *dst, const short *src, const size_t n) {
-    uint8_t *byte = dst;
-    const short *sh = src;
-    uint8_t * const loop_start = (uint8_t *)(((size_t)dst + 31) & ~31);
-    uint8_t * const loop_fin = (uint8_t *)(((size_t)dst + n) & ~31);
-    uint8_t * const fin = dst + n;
-    __m256i ySA, ySB;
-    static const __m256i yConst = _mm256_set1_epi16(128);
-    //アライメント調整
-    while (byte < loop_start) {
-        *byte = (*sh >> 8) + 128;
-        byte++;
-        sh++;
+size_t rgy_find_aacsync_avx2(const void *data_, const size_t data_size) {
+    const size_t target_size = AACSYNC_BYTES.size();
+    if (data_size < target_size) {
+        return RGY_MEMMEM_NOT_FOUND;
     }
-    //メインループ
-    while (byte < loop_fin) {
-        ySA = _mm256_set_m128i(_mm_loadu_si128((const __m128i*)(sh + 16)), _mm_loadu_si128((const __m128i*)(sh + 0)));
-        ySB = _mm256_set_m128i(_mm_loadu_si128((const __m128i*)(sh + 24)), _mm_loadu_si128((const __m128i*)(sh + 8)));
-        ySA = _mm256_srai_epi16(ySA, 8);
-        ySB = _mm256_srai_epi16(ySB, 8);
-        ySA = _mm256_add_epi16(ySA, yConst);
-        ySB = _mm256_add_epi16(ySB, yConst);
-        ySA = _mm256_packus_epi16(ySA, ySB);
-        _mm256_stream_si256((__m256i *)byte, ySA);
-        sh += 32;
-        byte += 32;
+    const uint8_t *data = (const uint8_t *)data_;
+    const __m256i ySync0 = _mm256_set1_epi8((char)AACSYNC_BYTES[0]);
+    const __m256i ySync1 = _mm256_set1_epi8((char)AACSYNC_BYTES[1]);
+    const int64_t fin64 = (int64_t)data_size - (int64_t)(target_size + 32 - 1); // r1の32byteロードが安全に行える限界
+    size_t i = 0;
+    if (fin64 > 0) {
+        const size_t fin = (size_t)fin64;
+        //まずは単純なロードで行えるところまでループ
+        for (; i < fin; i += 32) {
+            const __m256i r0 = _mm256_loadu_si256((const __m256i*)(data + i));
+            const __m256i r1 = _mm256_loadu_si256((const __m256i*)(data + i + 1));
+            const uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(r0, ySync0), _mm256_cmpeq_epi8(_mm256_and_si256(r1, ySync1), ySync1)));
+            if (mask != 0) {
+                return i + CTZ32(mask);
+            }
+        }
     }
-    //残り
-    while (byte < fin) {
-        *byte = (*sh >> 8) + 128;
-        byte++;
-        sh++;
+    //確保されているメモリ領域のページ境界を考慮しながらロード
+    const uint8_t *data_fin = data + data_size;
+    for (; i + target_size - 1 < data_size; i += 32) {
+        const __m256i r0 = _mm256_loadu_si256_no_page_overread(data + i, data_fin);
+        const __m256i r1 = _mm256_loadu_si256_no_page_overread(data + i + 1, data_fin);
+        const uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(r0, ySync0), _mm256_cmpeq_epi8(_mm256_and_si256(r1, ySync1), ySync1)));
+        if (mask != 0) {
+            const auto ret = i + CTZ32(mask);
+            return (ret + target_size - 1 < data_size) ? ret : RGY_MEMMEM_NOT_FOUND;
+        }
     }
+    return RGY_MEMMEM_NOT_FOUND;
 }
 
-void rgy_split_audio_16to8x2_avx2(uint8_t *dst0, uint8_t *dst1, const short *src, const size_t n) {
-    const short *sh = src;
-    const short *sh_fin = src + (n & ~15);
-    __m256i y0, y1, y2, y3;
-    __m256i yMask = _mm256_srli_epi16(_mm256_cmpeq_epi8(_mm256_setzero_si256(), _mm256_setzero_si256()), 8);
-    __m256i yConst = _mm256_set1_epi8(-128);
-    for (; sh < sh_fin; sh += 32, dst0 += 32, dst1 += 32) {
-        y0 = _mm256_set_m128i(_mm_loadu_si128((const __m128i*)(sh + 16)), _mm_loadu_si128((const __m128i*)(sh + 0)));
-        y1 = _mm256_set_m128i(_mm_loadu_si128((const __m128i*)(sh + 24)), _mm_loadu_si128((const __m128i*)(sh + 8)));
-        y2 = _mm256_and_si256(y0, yMask); //Lower8bit
-        y3 = _mm256_and_si256(y1, yMask); //Lower8bit
-        y0 = _mm256_srli_epi16(y0, 8);    //Upper8bit
-        y1 = _mm256_srli_epi16(y1, 8);    //Upper8bit
-        y2 = _mm256_packus_epi16(y2, y3);
-        y0 = _mm256_packus_epi16(y0, y1);
-        y2 = _mm256_add_epi8(y2, yConst);
+size_t rgy_memmem_faw_half_avx2(const void *data_, const size_t data_size, const void *target_, const size_t target_size, const bool upperhalf) {
+    if (data_size < target_size || target_size == 0) {
+        return RGY_MEMMEM_NOT_FOUND;
+    }
+    const uint16_t *data = (const uint16_t *)data_;
+    const uint8_t *target = (const uint8_t *)target_;
+    const size_t last = target_size - 1;
+    // 参照する8bitのみ残して、先頭と末尾のbyteを16bit単位で比較する
+    const int shift = (upperhalf) ? 8 : 0;
+    const __m256i yMask = _mm256_set1_epi16((short)(0xff << shift));
+    const __m256i yFirst = _mm256_set1_epi16((short)((uint8_t)(target[0] + 0x80) << shift));
+    const __m256i yLast = _mm256_set1_epi16((short)((uint8_t)(target[last] + 0x80) << shift));
+    const size_t fin = data_size - last; // 候補となる位置の数
+    size_t i = 0;
+    for (; i + 16 <= fin; i += 16) {
+        const __m256i r0 = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(data + i)), yMask);
+        const __m256i r1 = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(data + i + last)), yMask);
+        // 16bitごとに2bitずつ立つので、偶数bitのみ使う
+        uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi16(r0, yFirst), _mm256_cmpeq_epi16(r1, yLast))) & 0x55555555;
+        while (mask != 0) {
+            const auto j = CTZ32(mask) >> 1;
+            if (faw_half_equal(data + i + j, target, target_size, upperhalf)) {
+                return i + j;
+            }
+            mask = CLEAR_LEFT_BIT(mask);
+        }
+    }
+    for (; i < fin; i++) {
+        if (faw_half_equal(data + i, target, target_size, upperhalf)) {
+            return i;
+        }
+    }
+    return RGY_MEMMEM_NOT_FOUND;
+}
+
+// 16bit単位の加算/xorの結果をまとめ、posから残りの部分を計算する
+static RGY_FORCEINLINE uint32_t faw_checksum_reduce_avx2(const __m256i& ySum, const __m256i& yXor, const uint8_t *data, const size_t pos, const size_t data_size) {
+    alignas(16) uint16_t sum16[8], xor16[8];
+    _mm_store_si128((__m128i*)sum16, _mm_add_epi16(_mm256_castsi256_si128(ySum), _mm256_extracti128_si256(ySum, 1)));
+    _mm_store_si128((__m128i*)xor16, _mm_xor_si128(_mm256_castsi256_si128(yXor), _mm256_extracti128_si256(yXor, 1)));
+    uint32_t sum = 0, xor_ = 0;
+    for (int i = 0; i < 8; i++) {
+        sum += sum16[i];
+        xor_ ^= xor16[i];
+    }
+    return faw_checksum_tail(sum, xor_, data, pos, data_size);
+}
+
+uint32_t rgy_faw_checksum_avx2(const uint8_t *data, const size_t data_size) {
+    __m256i ySum = _mm256_setzero_si256();
+    __m256i yXor = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= data_size; i += 32) {
+        const __m256i y0 = _mm256_loadu_si256((const __m256i*)(data + i));
+        ySum = _mm256_add_epi16(ySum, y0);
+        yXor = _mm256_xor_si256(yXor, y0);
+    }
+    return faw_checksum_reduce_avx2(ySum, yXor, data, i, data_size);
+}
+
+uint32_t rgy_faw_copy_checksum_avx2(uint8_t *dst, const uint8_t *src, const size_t size) {
+    __m256i ySum = _mm256_setzero_si256();
+    __m256i yXor = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        const __m256i y0 = _mm256_loadu_si256((const __m256i*)(src + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), y0);
+        ySum = _mm256_add_epi16(ySum, y0);
+        yXor = _mm256_xor_si256(yXor, y0);
+    }
+    memcpy(dst + i, src + i, size - i);
+    return faw_checksum_reduce_avx2(ySum, yXor, src, i, size);
+}
+
+template<bool upperhalf>
+static RGY_FORCEINLINE uint32_t rgy_faw_read_half_checksum_avx2_imp(uint8_t *dst, const uint16_t *src, const size_t size) {
+    const __m256i yMask = _mm256_set1_epi16(0x00ff);
+    const __m256i yConst = _mm256_set1_epi8(-128);
+    __m256i ySum = _mm256_setzero_si256();
+    __m256i yXor = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i y0 = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i y1 = _mm256_loadu_si256((const __m256i*)(src + i + 16));
+        y0 = (upperhalf) ? _mm256_srli_epi16(y0, 8) : _mm256_and_si256(y0, yMask);
+        y1 = (upperhalf) ? _mm256_srli_epi16(y1, 8) : _mm256_and_si256(y1, yMask);
+        // packusは128bit単位で行われるので、並びを戻す
+        y0 = _mm256_permute4x64_epi64(_mm256_packus_epi16(y0, y1), _MM_SHUFFLE(3, 1, 2, 0));
         y0 = _mm256_add_epi8(y0, yConst);
-        _mm256_storeu_si256((__m256i*)dst0, y0);
-        _mm256_storeu_si256((__m256i*)dst1, y2);
+        _mm256_storeu_si256((__m256i*)(dst + i), y0);
+        ySum = _mm256_add_epi16(ySum, y0);
+        yXor = _mm256_xor_si256(yXor, y0);
+    }
+    for (size_t j = i; j < size; j++) {
+        dst[j] = faw_read_half<upperhalf>(src[j]);
     }
-    sh_fin = sh + (n & 15);
-    for (; sh < sh_fin; sh++, dst0++, dst1++) {
-        *dst0 = (*sh >> 8) + 128;
-        *dst1 = (*sh & 0xff) + 128;
+    return faw_checksum_reduce_avx2(ySum, yXor, dst, i, size);
+}
+
+uint32_t rgy_faw_read_half_checksum_avx2(uint8_t *dst, const void *src_, const size_t size, const bool upperhalf) {
+    return (upperhalf) ? rgy_faw_read_half_checksum_avx2_imp<true>(dst, (const uint16_t *)src_, size)
+                       : rgy_faw_read_half_checksum_avx2_imp<false>(dst, (const uint16_t *)src_, size);
+}
+
+void rgy_merge_audio_8x2to16_avx2(uint16_t *dst, const uint8_t *src0, const uint8_t *src1, const size_t n) {
+    const __m256i yConst = _mm256_set1_epi8(-128);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const __m256i y0 = _mm256_add_epi8(_mm256_loadu_si256((const __m256i*)(src0 + i)), yConst);
+        const __m256i y1 = _mm256_add_epi8(_mm256_loadu_si256((const __m256i*)(src1 + i)), yConst);
+        // unpackは128bit単位で行われるので、並びを戻す
+        const __m256i yLo = _mm256_unpacklo_epi8(y1, y0);
+        const __m256i yHi = _mm256_unpackhi_epi8(y1, y0);
+        _mm256_storeu_si256((__m256i*)(dst + i +  0), _mm256_permute2x128_si256(yLo, yHi, 0x20));
+        _mm256_storeu_si256((__m256i*)(dst + i + 16), _mm256_permute2x128_si256(yLo, yHi, 0x31));
     }
+    rgy_merge_audio_8x2to16_c(dst + i, src0 + i, src1 + i, n - i);
 }
 #endif
@@ -31,4 +31,161 @@
 size_t rgy_memmem_fawstart1_avx512bw(const void *data_, const size_t data_size) {
     return rgy_memmem_avx512_imp(data_, data_size, fawstart1.data(), fawstart1.size());
 }
+
+size_t rgy_find_aacsync_avx512bw(const void *data_, const size_t data_size) {
+    const size_t target_size = AACSYNC_BYTES.size();
+    if (data_size < target_size) {
+        return RGY_MEMMEM_NOT_FOUND;
+    }
+    const uint8_t *data = (const uint8_t *)data_;
+    const __m512i zSync0 = _mm512_set1_epi8((char)AACSYNC_BYTES[0]);
+    const __m512i zSync1 = _mm512_set1_epi8((char)AACSYNC_BYTES[1]);
+    const int64_t fin64 = (int64_t)data_size - (int64_t)(target_size + 64 - 1); // r1の64byteロードが安全に行える限界
+    size_t i = 0;
+    if (fin64 > 0) {
+        const size_t fin = (size_t)fin64;
+        //まずは単純なロードで行えるところまでループ
+        for (; i < fin; i += 64) {
+            const __m512i r0 = _mm512_loadu_si512((const __m512i*)(data + i));
+            const __m512i r1 = _mm512_loadu_si512((const __m512i*)(data + i + 1));
+            const uint64_t mask = _mm512_mask_cmpeq_epi8_mask(_mm512_cmpeq_epi8_mask(r0, zSync0), _mm512_and_si512(r1, zSync1), zSync1);
+            if (mask != 0) {
+                return i + CTZ64(mask);
+            }
+        }
+    }
+    //ロード範囲をmaskで考慮しながらロード
+    const uint8_t *data_fin = data + data_size;
+    for (; i + target_size - 1 < data_size; i += 64) {
+        const __m512i r0 = _mm512_loadu_si512_exact(data + i, data_fin);
+        const __m512i r1 = _mm512_loadu_si512_exact(data + i + 1, data_fin);
+        const uint64_t mask = _mm512_mask_cmpeq_epi8_mask(_mm512_cmpeq_epi8_mask(r0, zSync0), _mm512_and_si512(r1, zSync1), zSync1);
+        if (mask != 0) {
+            const auto ret = i + CTZ64(mask);
+            return (ret + target_size - 1 < data_size) ? ret : RGY_MEMMEM_NOT_FOUND;
+        }
+    }
+    return RGY_MEMMEM_NOT_FOUND;
+}
+
+size_t rgy_memmem_faw_half_avx512bw(const void *data_, const size_t data_size, const void *target_, const size_t target_size, const bool upperhalf) {
+    if (data_size < target_size || target_size == 0) {
+        return RGY_MEMMEM_NOT_FOUND;
+    }
+    const uint16_t *data = (const uint16_t *)data_;
+    const uint8_t *target = (const uint8_t *)target_;
+    const size_t last = target_size - 1;
+    // 参照する8bitのみ残して、先頭と末尾のbyteを16bit単位で比較する
+    const int shift = (upperhalf) ? 8 : 0;
+    const __m512i zMask = _mm512_set1_epi16((short)(0xff << shift));
+    const __m512i zFirst = _mm512_set1_epi16((short)((uint8_t)(target[0] + 0x80) << shift));
+    const __m512i zLast = _mm512_set1_epi16((short)((uint8_t)(target[last] + 0x80) << shift));
+    const size_t fin = data_size - last; // 候補となる位置の数
+    size_t i = 0;
+    for (; i + 32 <= fin; i += 32) {
+        const __m512i r0 = _mm512_and_si512(_mm512_loadu_si512((const __m512i*)(data + i)), zMask);
+        const __m512i r1 = _mm512_and_si512(_mm512_loadu_si512((const __m512i*)(data + i + last)), zMask);
+        uint32_t mask = _mm512_cmpeq_epi16_mask(r0, zFirst) & _mm512_cmpeq_epi16_mask(r1, zLast);
+        while (mask != 0) {
+            const auto j = CTZ32(mask);
+            if (faw_half_equal(data + i + j, target, target_size, upperhalf)) {
+                return i + j;
+            }
+            mask = CLEAR_LEFT_BIT(mask);
+        }
+    }
+    for (; i < fin; i++) {
+        if (faw_half_equal(data + i, target, target_size, upperhalf)) {
+            return i;
+        }
+    }
+    return RGY_MEMMEM_NOT_FOUND;
+}
+
+// 16bit単位の加算/xorの結果をまとめ、posから残りの部分を計算する
+static RGY_FORCEINLINE uint32_t faw_checksum_reduce_avx512(const __m512i& zSum, const __m512i& zXor, const uint8_t *data, const size_t pos, const size_t data_size) {
+    alignas(64) uint16_t sum16[32], xor16[32];
+    _mm512_store_si512((__m512i*)sum16, zSum);
+    _mm512_store_si512((__m512i*)xor16, zXor);
+    uint32_t sum = 0, xor_ = 0;
+    for (int i = 0; i < 32; i++) {
+        sum += sum16[i];
+        xor_ ^= xor16[i];
+    }
+    return faw_checksum_tail(sum, xor_, data, pos, data_size);
+}
+
+uint32_t rgy_faw_checksum_avx512bw(const uint8_t *data, const size_t data_size) {
+    __m512i zSum = _mm512_setzero_si512();
+    __m512i zXor = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 64 <= data_size; i += 64) {
+        const __m512i z0 = _mm512_loadu_si512((const __m512i*)(data + i));
+        zSum = _mm512_add_epi16(zSum, z0);
+        zXor = _mm512_xor_si512(zXor, z0);
+    }
+    return faw_checksum_reduce_avx512(zSum, zXor, data, i, data_size);
+}
+
+uint32_t rgy_faw_copy_checksum_avx512bw(uint8_t *dst, const uint8_t *src, const size_t size) {
+    __m512i zSum = _mm512_setzero_si512();
+    __m512i zXor = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64) {
+        const __m512i z0 = _mm512_loadu_si512((const __m512i*)(src + i));
+        _mm512_storeu_si512((__m512i*)(dst + i), z0);
+        zSum = _mm512_add_epi16(zSum, z0);
+        zXor = _mm512_xor_si512(zXor, z0);
+    }
+    memcpy(dst + i, src + i, size - i);
+    return faw_checksum_reduce_avx512(zSum, zXor, src, i, size);
+}
+
+template<bool upperhalf>
+static RGY_FORCEINLINE uint32_t rgy_faw_read_half_checksum_avx512bw_imp(uint8_t *dst, const uint16_t *src, const size_t size) {
+    const __m512i zMask = _mm512_set1_epi16(0x00ff);
+    const __m512i zConst = _mm512_set1_epi8(-128);
+    // packusは128bit単位で行われるので、並びを戻す
+    const __m512i zPermIdx = _mm512_set_epi64(7, 5, 3, 1, 6, 4, 2, 0);
+    __m512i zSum = _mm512_setzero_si512();
+    __m512i zXor = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64) {
+        __m512i z0 = _mm512_loadu_si512((const __m512i*)(src + i));
+        __m512i z1 = _mm512_loadu_si512((const __m512i*)(src + i + 32));
+        z0 = (upperhalf) ? _mm512_srli_epi16(z0, 8) : _mm512_and_si512(z0, zMask);
+        z1 = (upperhalf) ? _mm512_srli_epi16(z1, 8) : _mm512_and_si512(z1, zMask);
+        z0 = _mm512_maskz_permutexvar_epi64(0xff, zPermIdx, _mm512_packus_epi16(z0, z1));
+        z0 = _mm512_add_epi8(z0, zConst);
+        _mm512_storeu_si512((__m512i*)(dst + i), z0);
+        zSum = _mm512_add_epi16(zSum, z0);
+        zXor = _mm512_xor_si512(zXor, z0);
+    }
+    for (size_t j = i; j < size; j++) {
+        dst[j] = faw_read_half<upperhalf>(src[j]);
+    }
+    return faw_checksum_reduce_avx512(zSum, zXor, dst, i, size);
+}
+
+uint32_t rgy_faw_read_half_checksum_avx512bw(uint8_t *dst, const void *src_, const size_t size, const bool upperhalf) {
+    return (upperhalf) ? rgy_faw_read_half_checksum_avx512bw_imp<true>(dst, (const uint16_t *)src_, size)
+                       : rgy_faw_read_half_checksum_avx512bw_imp<false>(dst, (const uint16_t *)src_, size);
+}
+
+void rgy_merge_audio_8x2to16_avx512bw(uint16_t *dst, const uint8_t *src0, const uint8_t *src1, const size_t n) {
+    const __m512i zConst = _mm512_set1_epi8(-128);
+    // unpackは128bit単位で行われるので、並びを戻す
+    const __m512i zIdx0 = _mm512_set_epi64(11, 10, 3, 2,  9,  8, 1, 0);
+    const __m512i zIdx1 = _mm512_set_epi64(15, 14, 7, 6, 13, 12, 5, 4);
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        const __m512i z0 = _mm512_add_epi8(_mm512_loadu_si512((const __m512i*)(src0 + i)), zConst);
+        const __m512i z1 = _mm512_add_epi8(_mm512_loadu_si512((const __m512i*)(src1 + i)), zConst);
+        const __m512i zLo = _mm512_unpacklo_epi8(z1, z0);
+        const __m512i zHi = _mm512_unpackhi_epi8(z1, z0);
+        _mm512_storeu_si512((__m512i*)(dst + i +  0), _mm512_permutex2var_epi64(zLo, zIdx0, zHi));
+        _mm512_storeu_si512((__m512i*)(dst + i + 32), _mm512_permutex2var_epi64(zLo, zIdx1, zHi));
+    }
+    rgy_merge_audio_8x2to16_c(dst + i, src0 + i, src1 + i, n - i);
+}
 #endif
@@ -0,0 +1 @@
+#define ENCODER_REV "31"
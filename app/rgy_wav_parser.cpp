@@ -48,6 +48,7 @@ void RGYWAVHeader::init(const int channels, const int samplerate, const int elem
     block_align = wav_sample_size;
     bits_per_sample = elemsize * 8;
     data_size = datasize;
+    extra_size = 0;
 }
 
 uint32_t RGYWAVHeader::parseHeader(const uint8_t *data) {
@@ -108,7 +109,7 @@ std::vector<uint8_t> RGYWAVHeader::createHeader() {
     const int   size = bits_per_sample / 8;
 
     memcpy(head + 0, RIFF_HEADER, strlen(RIFF_HEADER));
-    *(int32_t*)(head + 4) = data_size + WAVE_HEADER_SIZE - 8;
+    *(int32_t*)(head + 4) = data_size + WAVE_HEADER_SIZE - 8 + extra_size;
     memcpy(head +  8, WAVE_HEADER, strlen(WAVE_HEADER));
     memcpy(head + 12, FMT_CHUNK, strlen(FMT_CHUNK));
     *(int32_t*)(head + 16) = FMT_SIZE;
@@ -123,3 +124,21 @@ std::vector<uint8_t> RGYWAVHeader::createHeader() {
     //計44byte(WAVE_HEADER_SIZE)
     return buffer;
 }
+
+bool RGYWAVHeader::findChunk(const uint8_t *data, const uint64_t size, const char *id, uint64_t& chunkOffset, uint32_t& chunkSize) {
+    // "RIFF" + 長さ + "WAVE" の後ろにchunkが続く (各chunkは2byte単位で配置される)
+    uint64_t pos = 12;
+    while (pos + 8 <= size) {
+        const uint32_t length = read_u32(data + pos + 4);
+        if (memcmp(data + pos, id, 4) == 0) {
+            if (pos + 8 + length > size) {
+                return false;
+            }
+            chunkOffset = pos + 8;
+            chunkSize = length;
+            return true;
+        }
+        pos += 8 + (uint64_t)length + (length & 1);
+    }
+    return false;
+}
@@ -47,10 +47,13 @@ struct RGYWAVHeader {
     uint16_t bits_per_sample;
     char data_id[5]; //"data"
     uint32_t data_size; // samples * number of channels * bits per sample / 8 (Actual number of bytes)
+    uint32_t extra_size; // data chunkの後ろに続くchunkの長さ (dataが奇数長の場合の1byteを含む)
 
     void init(const int channels, const int samplerate, const int elemsize, const uint32_t datasize);
     uint32_t parseHeader(const uint8_t *data);
     std::vector<uint8_t> createHeader();
+    // ファイル全体(data, size)からchunk idがidのchunkを探し、中身の位置と長さを返す
+    static bool findChunk(const uint8_t *data, const uint64_t size, const char *id, uint64_t& chunkOffset, uint32_t& chunkSize);
 };
 
 #endif //__RGY_WAV_PARSER_H__
@@ -0,0 +1,11 @@
+SRCS =  app/fawutil.cpp app/rgy_faw.cpp app/rgy_memmem.cpp app/rgy_simd.cpp app/rgy_wav_parser.cpp app/rgy_faw_avx2.cpp app/rgy_faw_avx512bw.cpp app/rgy_memmem_avx2.cpp app/rgy_memmem_avx512bw.cpp
+SRCDIR = .
+CC = gcc
+CXX = g++
+LD = g++
+PROGRAM = fawutil
+ENABLE_DEBUG = 0
+CFLAGS = -Wall -Wno-missing-braces -Wno-unknown-pragmas -Wno-unused -DLINUX -DUNIX -D_FILE_OFFSET_BITS=64 -D__USE_LARGEFILE64 -D__STDC_CONSTANT_MACROS -D__STDC_FORMAT_MACROS -DLINUX64 -m64 -O3 -DNDEBUG=1 -fPIE
+CXXFLAGS = -Wall -Wno-missing-braces -Wno-unknown-pragmas -Wno-unused -DLINUX -DUNIX -D_FILE_OFFSET_BITS=64 -D__USE_LARGEFILE64 -D__STDC_CONSTANT_MACROS -D__STDC_FORMAT_MACROS -I. -I./app -DLINUX64 -m64 -pthread -std=c++17 -DENABLE_IO_URING=1 -O3 -DNDEBUG=1 -mfpmath=sse -fPIE -ffast-math -fomit-frame-pointer
+LDFLAGS = -L. -ldl -lm -lstdc++ -lstdc++fs -m64 -lpthread -Wl,-s
+PREFIX = /usr/local
@@ -0,0 +1,452 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2023 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+// make check で実行するテスト
+// 引数にfawutilのパスを指定すると、fawutilで出力したファイルも確認する
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <functional>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include "rgy_faw.h"
+#if !(defined(_WIN32) || defined(_WIN64))
+#include <sys/resource.h>
+#endif
+
+// 最大RSS (KB) (取得できない場合は0)
+static uint64_t peak_rss_kb() {
+#if defined(_WIN32) || defined(_WIN64)
+    return 0;
+#else
+    rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+    return (uint64_t)usage.ru_maxrss;
+#endif
+}
+
+// 再現性のある乱数でbufferを埋める
+static void fill_noise(std::vector<uint8_t>& buffer, uint64_t& state) {
+    for (auto& b : buffer) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        b = (uint8_t)(state >> 32);
+    }
+}
+
+// 雑音のwavを1MBずつデコーダに渡し、最大RSSの増加が32MB以内であることを確認する
+// plantを指定した場合は、2つめのchunkの途中にパターンを書き込む
+static bool decode_noise(const int elemsize, const std::function<void(uint8_t *)>& plant, RGYFAWMode& mode, size_t& outputSize) {
+    static const size_t chunkSize = 1024 * 1024;
+    static const size_t inputSize = 200 * chunkSize;
+    RGYWAVHeader wavheader;
+    wavheader.init(2, 48000, elemsize, (uint32_t)inputSize);
+    RGYFAWDecoder decoder;
+    decoder.init(&wavheader);
+
+    std::vector<uint8_t> buffer(chunkSize);
+    uint64_t state = 88172645463325252ull;
+    RGYFAWDecoderOutput output;
+    outputSize = 0;
+    const auto rssStart = peak_rss_kb();
+    for (size_t pos = 0; pos < inputSize; pos += chunkSize) {
+        fill_noise(buffer, state);
+        if (pos == chunkSize && plant) {
+            plant(buffer.data() + 4096);
+        }
+        decoder.decode(output, buffer.data(), buffer.size());
+        outputSize += output[0].size() + output[1].size();
+    }
+    decoder.fin(output);
+    outputSize += output[0].size() + output[1].size();
+    mode = decoder.mode();
+    const auto rssGrowth = peak_rss_kb() - rssStart;
+    if (rssGrowth > 32 * 1024) {
+        fprintf(stderr, "  peak RSS grew by %llu KB.\n", (unsigned long long)rssGrowth);
+        return false;
+    }
+    return true;
+}
+
+// FAWを含まない雑音が続いても、デコーダのメモリ使用量が増え続けないこと
+static bool test_decoder_noise() {
+    RGYFAWMode mode = RGYFAWMode::Unknown;
+    size_t outputSize = 0;
+    if (!decode_noise(2, nullptr, mode, outputSize)) {
+        return false;
+    }
+    if (mode != RGYFAWMode::Unknown || outputSize > 0) {
+        fprintf(stderr, "  noise was detected as FAW.\n");
+        return false;
+    }
+    return true;
+}
+
+// fawfin1のないfawstart1の後に雑音が続いても、デコーダのメモリ使用量が増え続けないこと
+static bool test_decoder_fawstart1_without_fawfin1() {
+    RGYFAWMode mode = RGYFAWMode::Unknown;
+    size_t outputSize = 0;
+    auto plant = [](uint8_t *ptr) {
+        memcpy(ptr, fawstart1.data(), fawstart1.size());
+    };
+    if (!decode_noise(1, plant, mode, outputSize)) {
+        return false;
+    }
+    if (mode != RGYFAWMode::Full) {
+        fprintf(stderr, "  fawstart1 was not detected.\n");
+        return false;
+    }
+    return true;
+}
+
+// FAW half size mixの片方の音声にのみfawstart1がある雑音が続いても、デコーダのメモリ使用量が増え続けないこと
+static bool test_decoder_one_sided_fawstart1() {
+    RGYFAWMode mode = RGYFAWMode::Unknown;
+    size_t outputSize = 0;
+    auto plant = [](uint8_t *ptr) {
+        // 上位8bitにのみfawstart1を置く (16bit値の(値-128)がfawstart1)
+        for (size_t i = 0; i < fawstart1.size(); i++) {
+            ptr[i * 2 + 1] = (uint8_t)(fawstart1[i] + 128);
+        }
+    };
+    if (!decode_noise(2, plant, mode, outputSize)) {
+        return false;
+    }
+    if (mode != RGYFAWMode::Unknown || outputSize > 0) {
+        fprintf(stderr, "  noise was detected as FAW.\n");
+        return false;
+    }
+    return true;
+}
+
+// "fawi" chunkを作成し、wavの中から探して読み取ると元のindexに戻ること
+static bool test_index_chunk_roundtrip() {
+    std::vector<RGYFAWBlockIndex> index;
+    for (uint32_t i = 0; i < 100; i++) {
+        index.push_back({ 4 + (uint64_t)i * 0x123456789ull, i, 100 + i * 7, 0x9E3779B9u * i, i & 1 });
+    }
+    // dataが奇数長の場合は、chunkの前に1byte入る
+    const uint32_t dataSize = 1001;
+    const auto chunk = rgy_faw_create_index_chunk(index);
+    RGYWAVHeader wavheader;
+    wavheader.init(1, 48000, 1, dataSize);
+    wavheader.extra_size = (uint32_t)(1 + chunk.size());
+    auto file = wavheader.createHeader();
+    file.resize(file.size() + dataSize + 1, 0);
+    file.insert(file.end(), chunk.begin(), chunk.end());
+
+    uint64_t chunkOffset = 0;
+    uint32_t chunkSize = 0;
+    std::vector<RGYFAWBlockIndex> parsed;
+    if (!RGYWAVHeader::findChunk(file.data(), file.size(), FAW_INDEX_CHUNK_ID, chunkOffset, chunkSize)
+        || !rgy_faw_parse_index_chunk(parsed, file.data() + chunkOffset, chunkSize)
+        || parsed.size() != index.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < index.size(); i++) {
+        if (memcmp(&parsed[i].offset, &index[i].offset, sizeof(index[i].offset)) != 0
+            || parsed[i].frame != index[i].frame || parsed[i].size != index[i].size
+            || parsed[i].checksum != index[i].checksum || parsed[i].track != index[i].track) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// ADTSフレームを並べたaacを作成する (sizesには各フレームの長さ(ヘッダを含む)を返す)
+static std::vector<uint8_t> make_test_aac(const int frames, uint64_t state, const size_t payloadRange, std::vector<uint32_t> *sizes) {
+    std::vector<uint8_t> aac;
+    for (int i = 0; i < frames; i++) {
+        std::vector<uint8_t> payload(64 + (i * 37) % payloadRange);
+        fill_noise(payload, state);
+        for (auto& b : payload) {
+            b &= 0x7f; // syncwordが現れないようにする
+        }
+        const uint32_t length = (uint32_t)(AAC_HEADER_MIN_SIZE + payload.size());
+        // MPEG-4 AAC LC, 48kHz, 2ch, CRCなし
+        const uint8_t header[AAC_HEADER_MIN_SIZE] = {
+            0xFF, 0xF1, 0x4C, (uint8_t)(0x80 | (length >> 11)), (uint8_t)(length >> 3), (uint8_t)(((length & 7) << 5) | 0x1F), 0xFC
+        };
+        aac.insert(aac.end(), header, header + sizeof(header));
+        aac.insert(aac.end(), payload.begin(), payload.end());
+        if (sizes) {
+            sizes->push_back(length);
+        }
+    }
+    return aac;
+}
+
+// ADTSフレームを並べたaacを作成し、各フレームの長さ(ヘッダを含む)を返す
+static std::vector<uint32_t> write_test_aac(const std::string& filename, const int frames, uint64_t state) {
+    std::vector<uint32_t> sizes;
+    const auto aac = make_test_aac(frames, state, 600, &sizes);
+    std::ofstream(filename, std::ios::binary).write((const char *)aac.data(), aac.size());
+    return sizes;
+}
+
+static std::vector<uint8_t> read_file(const std::string& filename) {
+    std::ifstream ifs(filename, std::ios::binary);
+    return std::vector<uint8_t>(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+}
+
+// fawutil -i で出力したファイルの"fawi" chunkが、各ブロックの位置・長さ・checksumと一致すること
+static bool test_index_file(const std::string& fawutil, const bool mix) {
+    static const int frames = 500;
+    const std::string aac0 = "fawutil_test_0.aac", aac1 = "fawutil_test_1.aac", wav = "fawutil_test.wav";
+    const std::vector<std::vector<uint32_t>> sizes = {
+        write_test_aac(aac0, frames, 1),
+        write_test_aac(aac1, frames - 100, 2)
+    };
+    const std::string cmd = "\"" + fawutil + "\" -i " + aac0 + ((mix) ? " " + aac1 : "") + " " + wav + " 2> " + ((mix) ? aac1 + ".log" : aac0 + ".log");
+    const int ret = system(cmd.c_str());
+    auto file = read_file(wav);
+    remove(aac0.c_str());
+    remove(aac1.c_str());
+    remove((aac0 + ".log").c_str());
+    remove((aac1 + ".log").c_str());
+    remove(wav.c_str());
+    if (ret != 0) {
+        fprintf(stderr, "  failed to run: %s\n", cmd.c_str());
+        return false;
+    }
+    uint64_t indexOffset = 0, dataOffset = 0;
+    uint32_t indexSize = 0, dataSize = 0;
+    std::vector<RGYFAWBlockIndex> index;
+    if (!RGYWAVHeader::findChunk(file.data(), file.size(), FAW_INDEX_CHUNK_ID, indexOffset, indexSize)
+        || !RGYWAVHeader::findChunk(file.data(), file.size(), "data", dataOffset, dataSize)
+        || !rgy_faw_parse_index_chunk(index, file.data() + indexOffset, indexSize)) {
+        fprintf(stderr, "  block index not found.\n");
+        return false;
+    }
+    // 各ブロックはtrackごとに入力のフレーム順に並ぶ
+    std::vector<uint32_t> nextFrame(2, 0);
+    for (const auto& entry : index) {
+        if (entry.track >= ((mix) ? 2u : 1u) || entry.frame != nextFrame[entry.track]
+            || entry.size != sizes[entry.track][entry.frame]) {
+            fprintf(stderr, "  unexpected entry: track %u, frame %u, size %u.\n", entry.track, entry.frame, entry.size);
+            return false;
+        }
+        nextFrame[entry.track]++;
+    }
+    // FAW mixでは末尾のブロックが出力されないことがあるので、各trackにブロックがあることのみ確認する
+    if ((!mix && nextFrame[0] != sizes[0].size()) || (mix && (nextFrame[0] == 0 || nextFrame[1] == 0))) {
+        fprintf(stderr, "  number of blocks does not match.\n");
+        return false;
+    }
+    const auto mode = (mix) ? RGYFAWMode::Mix : RGYFAWMode::Full;
+    if (rgy_faw_verify_index(index, file.data() + dataOffset, dataSize, mode) != 0) {
+        fprintf(stderr, "  block index does not match the data.\n");
+        return false;
+    }
+    // ブロックを壊すと、そのブロックのみ一致しなくなる
+    file[dataOffset + index[index.size() / 2].offset + index[index.size() / 2].size / 2 * ((mix) ? 2 : 1)] ^= 0x40;
+    if (rgy_faw_verify_index(index, file.data() + dataOffset, dataSize, mode) != 1) {
+        fprintf(stderr, "  broken block was not detected.\n");
+        return false;
+    }
+    return true;
+}
+
+// aacをエンコードし、16bit 2chのwavのdata部分を返す
+// FAW halfは1つめの音声のみ、FAW mixは2つの音声を16bitの上位/下位8bitに入れる
+// FAW half size mixでは、2つめの音声の前にFAWではないデータ(ノイズ)をdelay1 byte分置く
+static std::vector<uint8_t> encode_test_faw(const RGYFAWMode fawmode, const std::vector<uint8_t>& aac0, const std::vector<uint8_t>& aac1, const size_t delay1 = 0) {
+    auto encode = [](const RGYFAWMode mode, const std::vector<uint8_t>& aac) {
+        RGYWAVHeader wavheader;
+        wavheader.init(2, 48000, (mode == RGYFAWMode::Full) ? sizeof(short) : sizeof(char), 0);
+        RGYFAWEncoder encoder;
+        encoder.init(&wavheader, mode, 0);
+        RGYFAWEncoderOutput output;
+        std::vector<uint8_t> data;
+        auto append = [&]() {
+            data.resize(data.size() + output.zeroHead, 0);
+            data.insert(data.end(), output.data.begin(), output.data.end());
+            data.resize(data.size() + output.zeroTail, 0);
+            output.clear();
+        };
+        encoder.encode(output, aac.data(), aac.size());
+        append();
+        encoder.fin(output);
+        append();
+        return data;
+    };
+    if (fawmode == RGYFAWMode::Full) {
+        return encode(RGYFAWMode::Full, aac0);
+    }
+    auto half0 = encode(RGYFAWMode::Half, aac0);
+    // FAW halfでは、下位8bitは無音(0)とする
+    auto half1 = (fawmode == RGYFAWMode::Mix) ? encode(RGYFAWMode::Half, aac1) : std::vector<uint8_t>(half0.size(), 128);
+    std::vector<uint8_t> noise(delay1);
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+    fill_noise(noise, state);
+    half1.insert(half1.begin(), noise.begin(), noise.end());
+    const size_t length = std::max(half0.size(), half1.size());
+    half0.resize(length, 0);
+    half1.resize(length, 0);
+    std::vector<uint8_t> data(length * sizeof(uint16_t));
+    get_merge_audio_8x2to16_func()((uint16_t *)data.data(), half0.data(), half1.data(), length);
+    return data;
+}
+
+// dataをpiecesの長さずつ順にデコーダに渡す (piecesを使い切ったら先頭から繰り返す)
+static RGYFAWDecoderOutput decode_test_faw(const std::vector<uint8_t>& data, const int threads, const std::vector<size_t>& pieces, RGYFAWMode& mode) {
+    RGYWAVHeader wavheader;
+    wavheader.init(2, 48000, sizeof(short), (uint32_t)data.size());
+    RGYFAWDecoder decoder;
+    decoder.setThreads(threads);
+    decoder.init(&wavheader);
+    RGYFAWDecoderOutput result, output;
+    auto append = [&]() {
+        for (size_t i = 0; i < result.size(); i++) {
+            result[i].insert(result[i].end(), output[i].begin(), output[i].end());
+        }
+    };
+    for (size_t pos = 0, ipiece = 0; pos < data.size(); ipiece++) {
+        const size_t length = std::min(pieces[ipiece % pieces.size()], data.size() - pos);
+        decoder.decode(output, data.data() + pos, length);
+        append();
+        pos += length;
+    }
+    decoder.fin(output);
+    append();
+    mode = decoder.mode();
+    return result;
+}
+
+// 入力を範囲に分けて並列にデコードした結果が、1スレッドでデコードした結果と一致すること
+// ブロックが間隔の大半を占めるようにして、範囲の境界がブロックの途中になるようにする
+// 壊れたブロックも含め、デコーダに渡す長さ(サンプル単位)も変えて確認する
+static bool test_decoder_parallel(const RGYFAWMode fawmode) {
+    const auto aac0 = make_test_aac(3000, 11, 1800, nullptr);
+    const auto aac1 = make_test_aac(2500, 12, 1800, nullptr);
+    auto data = encode_test_faw(fawmode, aac0, aac1);
+    for (size_t pos = 12345; pos < data.size(); pos += 1000003) {
+        data[pos] ^= 0x20;
+    }
+    RGYFAWMode mode = RGYFAWMode::Unknown;
+    const auto expected = decode_test_faw(data, 1, { data.size() }, mode);
+    if (mode != fawmode || expected[0].size() == 0 || (fawmode == RGYFAWMode::Mix && expected[1].size() == 0)) {
+        fprintf(stderr, "  failed to decode with 1 thread.\n");
+        return false;
+    }
+    const std::vector<std::vector<size_t>> piecesList = {
+        { data.size() },
+        { 5 * 1024 * 1024 + 12344 },
+        { 1024 * 1024 + 776, 3 * 1024 * 1024 + 4100 },
+    };
+    for (const int threads : { 2, 3, 4, 8 }) {
+        for (const auto& pieces : piecesList) {
+            const auto output = decode_test_faw(data, threads, pieces, mode);
+            if (output != expected) {
+                fprintf(stderr, "  output differs with %d threads, %llu bytes per call.\n", threads, (unsigned long long)pieces[0]);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// パイプからの入力のように、サンプルの途中で切れた長さずつ渡しても、まとめて渡した場合と同じ結果になること
+static bool test_decoder_odd_pieces(const RGYFAWMode fawmode) {
+    const auto aac0 = make_test_aac(1000, 21, 1800, nullptr);
+    const auto aac1 = make_test_aac(900, 22, 1800, nullptr);
+    const auto data = encode_test_faw(fawmode, aac0, aac1);
+    RGYFAWMode mode = RGYFAWMode::Unknown;
+    const auto expected = decode_test_faw(data, 1, { data.size() }, mode);
+    if (mode != fawmode || expected[0].size() == 0) {
+        fprintf(stderr, "  failed to decode.\n");
+        return false;
+    }
+    const std::vector<size_t> pieces = { 1, 3, 4093, 5, 8191, 7, 65537, 2, 1023 };
+    for (const int threads : { 1, 2 }) {
+        const auto output = decode_test_faw(data, threads, pieces, mode);
+        if (output != expected) {
+            fprintf(stderr, "  output differs with %d threads.\n", threads);
+            return false;
+        }
+    }
+    return true;
+}
+
+// FAW half size mixの片方の音声が遅れて始まる場合も、少しずつ渡した結果がまとめて渡した場合と同じになること
+static bool test_decoder_delayed_mix() {
+    const auto aac0 = make_test_aac(1000, 23, 1800, nullptr);
+    const auto aac1 = make_test_aac(900, 24, 1800, nullptr);
+    // 300ブロック分 (1ブロック = 1024サンプル x 2ch)
+    const auto data = encode_test_faw(RGYFAWMode::Mix, aac0, aac1, 300 * 1024 * 2);
+    RGYFAWMode mode = RGYFAWMode::Unknown;
+    const auto expected = decode_test_faw(data, 1, { data.size() }, mode);
+    if (mode != RGYFAWMode::Mix || expected[0].size() == 0 || expected[1].size() == 0) {
+        fprintf(stderr, "  failed to decode.\n");
+        return false;
+    }
+    for (const size_t piece : { 8192, 65536 }) {
+        const auto output = decode_test_faw(data, 1, { piece }, mode);
+        if (output != expected) {
+            fprintf(stderr, "  output differs with %llu bytes per call.\n", (unsigned long long)piece);
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    struct Test {
+        const char *name;
+        std::function<bool()> func;
+    };
+    std::vector<Test> tests = {
+        { "decoder_noise", test_decoder_noise },
+        { "decoder_fawstart1_without_fawfin1", test_decoder_fawstart1_without_fawfin1 },
+        { "decoder_one_sided_fawstart1", test_decoder_one_sided_fawstart1 },
+        { "decoder_parallel_full", []() { return test_decoder_parallel(RGYFAWMode::Full); } },
+        { "decoder_parallel_half", []() { return test_decoder_parallel(RGYFAWMode::Half); } },
+        { "decoder_parallel_mix", []() { return test_decoder_parallel(RGYFAWMode::Mix); } },
+        { "decoder_odd_pieces_full", []() { return test_decoder_odd_pieces(RGYFAWMode::Full); } },
+        { "decoder_odd_pieces_half", []() { return test_decoder_odd_pieces(RGYFAWMode::Half); } },
+        { "decoder_odd_pieces_mix", []() { return test_decoder_odd_pieces(RGYFAWMode::Mix); } },
+        { "decoder_delayed_mix", test_decoder_delayed_mix },
+        { "index_chunk_roundtrip", test_index_chunk_roundtrip },
+    };
+    if (argc > 1) {
+        const std::string fawutil = argv[1];
+        tests.push_back({ "index_file_full", [fawutil]() { return test_index_file(fawutil, false); } });
+        tests.push_back({ "index_file_mix", [fawutil]() { return test_index_file(fawutil, true); } });
+    }
+    int failed = 0;
+    for (const auto& test : tests) {
+        const bool ok = test.func();
+        fprintf(stderr, "%s %s\n", (ok) ? "[OK]" : "[NG]", test.name);
+        failed += (ok) ? 0 : 1;
+    }
+    return (failed > 0) ? 1 : 0;
+}